@@ -0,0 +1,481 @@
+#include "cache.h"
+#include "hash.h"
+
+
+static CacheShard *ShardOf(unsigned long hash);
+static CacheEntry **BucketOf(CacheShard *shard, unsigned long hash);
+static CacheEntry *FindEntry(CacheShard *shard, char *uri, unsigned long hash);
+static CacheEntry *FindFlight(CacheShard *shard, char *uri, unsigned long hash);
+static void EndFlight(CacheEntry *fill, int state);
+static CacheEntry *LookupOrFill(char *uri, CacheEntry **fill, int wait);
+static CacheEntry *BeginCacheFill(char *uri, unsigned long hash);
+static void LinkEntry(CacheShard *shard, CacheEntry *entry);
+static void UnlinkEntry(CacheShard *shard, CacheEntry *entry);
+static void MakeRoom(size_t size);
+static CacheEntry *EvictVictim(CacheShard *shard);
+static void FreeEntry(CacheEntry *entry);
+
+
+static Cache cache;
+
+
+void InitCache(CachePolicy *policy, CacheEvictCallback evicted)
+{
+    cache.policy = policy;
+    cache.evicted = evicted;
+    cache.size = 0;
+    cache.evict_hand = 0;
+
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache.shards[i];
+
+        memset(shard, 0, sizeof(CacheShard));
+        pthread_rwlock_init(&shard->lock, NULL);
+        pthread_mutex_init(&shard->flight_mutex, NULL);
+        pthread_cond_init(&shard->flight_done, NULL);
+        pthread_mutex_init(&shard->promote_mutex, NULL);
+        if (policy->Init)
+            policy->Init(shard);
+    }
+}
+
+
+/*
+ * TryReadCache - Return the entry cached for uri pinned with a reference,
+ *     or NULL on a miss. Only the shard the uri hashes to is locked, and
+ *     only for reading. The caller sends entry->obj straight from the
+ *     cache and must call ReleaseCacheEntry when done with it.
+ */
+CacheEntry *TryReadCache(char *uri)
+{
+    unsigned long hash = HashString(uri);
+    CacheShard *shard = ShardOf(hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    CacheEntry *entry = FindEntry(shard, uri, hash);
+    if (cache.policy->OnAccess)
+        cache.policy->OnAccess(shard, hash);
+    if (entry != NULL)
+    {
+        __atomic_add_fetch(&entry->ref_cnt, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&entry->hits, 1, __ATOMIC_RELAXED);
+        cache.policy->OnHit(shard, entry);
+        __atomic_add_fetch(&shard->hits, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_add_fetch(&shard->misses, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    return entry;
+}
+
+
+/*
+ * ReadCacheOrFill - Return the entry cached for uri pinned, like
+ *     TryReadCache. On a miss the first caller gets NULL and a pending
+ *     *fill to fetch the object into, which it must publish or abort.
+ *     Callers missing the same uri meanwhile wait for that fill and get
+ *     the entry it publishes instead of fetching it again. If the fill is
+ *     aborted, the waiters get NULL with *fill NULL and fetch uncached.
+ */
+CacheEntry *ReadCacheOrFill(char *uri, CacheEntry **fill)
+{
+    return LookupOrFill(uri, fill, 1);
+}
+
+
+/*
+ * PollCacheOrFill - ReadCacheOrFill for callers that must not block. A
+ *     miss on a uri already in flight returns NULL with *fill NULL right
+ *     away, to be fetched uncached.
+ */
+CacheEntry *PollCacheOrFill(char *uri, CacheEntry **fill)
+{
+    return LookupOrFill(uri, fill, 0);
+}
+
+
+/*
+ * BeginCacheRefresh - Start a fill to fetch stale, a cached entry, again
+ *     into. The entry stays cached meanwhile, and the fill replaces it
+ *     once published. Returns NULL if a fill of its uri is in flight
+ *     already, the caller then fetches uncached.
+ */
+CacheEntry *BeginCacheRefresh(CacheEntry *stale)
+{
+    CacheShard *shard = ShardOf(stale->hash);
+    CacheEntry *fill = NULL;
+
+    pthread_mutex_lock(&shard->flight_mutex);
+    if (FindFlight(shard, stale->uri, stale->hash) == NULL)
+    {
+        fill = BeginCacheFill(stale->uri, stale->hash);
+        fill->next = shard->flights;
+        shard->flights = fill;
+    }
+    pthread_mutex_unlock(&shard->flight_mutex);
+    return fill;
+}
+
+
+/* PinCacheEntry - Take another reference to entry, and return it */
+CacheEntry *PinCacheEntry(CacheEntry *entry)
+{
+    __atomic_add_fetch(&entry->ref_cnt, 1, __ATOMIC_RELAXED);
+    return entry;
+}
+
+
+void ReleaseCacheEntry(CacheEntry *entry)
+{
+    if (__atomic_sub_fetch(&entry->ref_cnt, 1, __ATOMIC_ACQ_REL) == 0)
+        FreeEntry(entry);
+}
+
+
+/*
+ * ReserveCacheFill - Size the buffer of fill for an object of size bytes
+ *     known in advance, so appending it never reallocates. Returns 0 and
+ *     frees fill if the object cannot be cached, 1 otherwise.
+ */
+int ReserveCacheFill(CacheEntry *fill, size_t size)
+{
+    if (size > MAX_OBJECT_SIZE)
+    {
+        AbortCacheFill(fill);
+        return 0;
+    }
+
+    if (size > fill->obj_cap)
+    {
+        fill->obj_cap = size;
+        fill->obj = Realloc(fill->obj, fill->obj_cap);
+    }
+    return 1;
+}
+
+
+/*
+ * AppendCacheFill - Append n bytes of the response to fill. Returns 0 and
+ *     frees fill once the object exceeds MAX_OBJECT_SIZE and cannot be
+ *     cached, 1 otherwise.
+ */
+int AppendCacheFill(CacheEntry *fill, char *buf, size_t n)
+{
+    if (fill->obj_size + n > MAX_OBJECT_SIZE)
+    {
+        AbortCacheFill(fill);
+        return 0;
+    }
+
+    if (fill->obj_size + n > fill->obj_cap)
+    {
+        while (fill->obj_size + n > fill->obj_cap)
+            fill->obj_cap *= 2;
+        if (fill->obj_cap > MAX_OBJECT_SIZE)
+            fill->obj_cap = MAX_OBJECT_SIZE;
+        fill->obj = Realloc(fill->obj, fill->obj_cap);
+    }
+    memcpy(fill->obj + fill->obj_size, buf, n);
+    fill->obj_size += n;
+    return 1;
+}
+
+
+/*
+ * PublishCacheFill - Link the completed fill into the cache, evicting the
+ *     victims of the cache policy until the cached objects fit in
+ *     MAX_CACHE_SIZE again. An entry cached for the uri meanwhile, or the
+ *     stale one a refresh was started for, is replaced, as the fill holds
+ *     the newer response. The caller's reference passes to the cache.
+ */
+void PublishCacheFill(CacheEntry *fill)
+{
+    size_t size = fill->obj_size;
+
+    if (size == 0)
+    {
+        AbortCacheFill(fill);
+        return;
+    }
+
+    MakeRoom(size);
+
+    CacheShard *shard = ShardOf(fill->hash);
+    pthread_mutex_lock(&shard->flight_mutex);
+    pthread_rwlock_wrlock(&shard->lock);
+
+    CacheEntry *old = FindEntry(shard, fill->uri, fill->hash);
+    if (old != NULL)
+    {
+        UnlinkEntry(shard, old);
+        cache.policy->Remove(shard, old);
+    }
+
+    /* Leave flights first, linking reuses fill->next */
+    EndFlight(fill, FILL_PUBLISHED);
+    LinkEntry(shard, fill);
+    shard->inserts++;
+    pthread_rwlock_unlock(&shard->lock);
+    pthread_mutex_unlock(&shard->flight_mutex);
+
+    /* Readers still sending the old entry keep it until they are done */
+    if (old != NULL)
+    {
+        __atomic_sub_fetch(&cache.size, old->obj_size, __ATOMIC_RELAXED);
+        ReleaseCacheEntry(old);
+    }
+}
+
+
+/* AbortCacheFill - Drop fill, waking the callers waiting for it */
+void AbortCacheFill(CacheEntry *fill)
+{
+    CacheShard *shard = ShardOf(fill->hash);
+
+    pthread_mutex_lock(&shard->flight_mutex);
+    EndFlight(fill, FILL_ABORTED);
+    pthread_mutex_unlock(&shard->flight_mutex);
+    ReleaseCacheEntry(fill);
+}
+
+
+/* GetCacheStats - Sum up the counters of all shards */
+void GetCacheStats(CacheStats *stats)
+{
+    memset(stats, 0, sizeof(CacheStats));
+    stats->policy = cache.policy->name;
+    stats->size = __atomic_load_n(&cache.size, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache.shards[i];
+
+        stats->hits += __atomic_load_n(&shard->hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&shard->misses, __ATOMIC_RELAXED);
+        stats->coalesced += __atomic_load_n(&shard->coalesced, __ATOMIC_RELAXED);
+        stats->inserts += __atomic_load_n(&shard->inserts, __ATOMIC_RELAXED);
+        stats->evictions += __atomic_load_n(&shard->evictions, __ATOMIC_RELAXED);
+    }
+}
+
+
+static CacheShard *ShardOf(unsigned long hash)
+{
+    return &cache.shards[hash & (CACHE_SHARDS - 1)];
+}
+
+
+static CacheEntry **BucketOf(CacheShard *shard, unsigned long hash)
+{
+    return &shard->buckets[(hash / CACHE_SHARDS) & (CACHE_BUCKETS - 1)];
+}
+
+
+/* Caller holds the lock of shard */
+static CacheEntry *FindEntry(CacheShard *shard, char *uri, unsigned long hash)
+{
+    for (CacheEntry *entry = *BucketOf(shard, hash); entry; entry = entry->next)
+    {
+        if (entry->hash == hash && !strcmp(uri, entry->uri))
+            return entry;
+    }
+    return NULL;
+}
+
+
+/* Caller holds the flight_mutex of shard */
+static CacheEntry *FindFlight(CacheShard *shard, char *uri, unsigned long hash)
+{
+    for (CacheEntry *fill = shard->flights; fill; fill = fill->next)
+    {
+        if (fill->hash == hash && !strcmp(uri, fill->uri))
+            return fill;
+    }
+    return NULL;
+}
+
+
+/*
+ * EndFlight - Take fill off the flights of its shard and wake the callers
+ *     waiting for it. Caller holds the flight_mutex of the shard.
+ */
+static void EndFlight(CacheEntry *fill, int state)
+{
+    CacheShard *shard = ShardOf(fill->hash);
+    CacheEntry **link = &shard->flights;
+
+    while (*link != NULL && *link != fill)
+        link = &(*link)->next;
+    if (*link != NULL)
+        *link = fill->next;
+
+    fill->fill_state = state;
+    pthread_cond_broadcast(&shard->flight_done);
+}
+
+
+/*
+ * LookupOrFill - The lookup behind ReadCacheOrFill and PollCacheOrFill,
+ *     wait tells whether to wait for a fill of uri already in flight.
+ */
+static CacheEntry *LookupOrFill(char *uri, CacheEntry **fill, int wait)
+{
+    unsigned long hash = HashString(uri);
+    CacheShard *shard = ShardOf(hash);
+    CacheEntry *entry, *flight;
+
+    *fill = NULL;
+    if ((entry = TryReadCache(uri)) != NULL)
+        return entry;
+
+    pthread_mutex_lock(&shard->flight_mutex);
+    if ((flight = FindFlight(shard, uri, hash)) != NULL && !wait)
+    {
+        pthread_mutex_unlock(&shard->flight_mutex);
+        return NULL;
+    }
+    if (flight != NULL)
+    {
+        /* The pin keeps flight alive after its fetcher lets go of it */
+        __atomic_add_fetch(&flight->ref_cnt, 1, __ATOMIC_RELAXED);
+        while (flight->fill_state == FILL_PENDING)
+            pthread_cond_wait(&shard->flight_done, &shard->flight_mutex);
+        pthread_mutex_unlock(&shard->flight_mutex);
+
+        if (flight->fill_state == FILL_ABORTED)
+        {
+            ReleaseCacheEntry(flight);
+            return NULL;
+        }
+        __atomic_add_fetch(&shard->coalesced, 1, __ATOMIC_RELAXED);
+        return flight;
+    }
+
+    /*
+     * A fill leaves flights and is linked under flight_mutex in one step,
+     * so one published since our lookup is found now
+     */
+    pthread_rwlock_rdlock(&shard->lock);
+    if ((entry = FindEntry(shard, uri, hash)) != NULL)
+        __atomic_add_fetch(&entry->ref_cnt, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (entry == NULL)
+    {
+        *fill = BeginCacheFill(uri, hash);
+        (*fill)->next = shard->flights;
+        shard->flights = *fill;
+    }
+    pthread_mutex_unlock(&shard->flight_mutex);
+    return entry;
+}
+
+
+/*
+ * BeginCacheFill - Start a pending entry for uri. The response is appended
+ *     to it as it streams in, and it only becomes visible to readers once
+ *     published, complete and immutable.
+ */
+static CacheEntry *BeginCacheFill(char *uri, unsigned long hash)
+{
+    CacheEntry *fill = Calloc(1, sizeof(CacheEntry));
+
+    fill->uri = Malloc(strlen(uri) + 1);
+    strcpy(fill->uri, uri);
+    fill->hash = hash;
+    fill->obj_cap = FILL_INIT_SIZE;
+    fill->obj = Malloc(fill->obj_cap);
+    fill->ref_cnt = 1;
+    fill->fill_state = FILL_PENDING;
+    return fill;
+}
+
+
+/* Caller holds the lock of shard for writing */
+static void LinkEntry(CacheShard *shard, CacheEntry *entry)
+{
+    CacheEntry **bucket = BucketOf(shard, entry->hash);
+
+    entry->next = *bucket;
+    *bucket = entry;
+    cache.policy->OnInsert(shard, entry);
+}
+
+
+/* Caller holds the lock of shard for writing */
+static void UnlinkEntry(CacheShard *shard, CacheEntry *entry)
+{
+    CacheEntry **link = BucketOf(shard, entry->hash);
+
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+}
+
+
+/*
+ * MakeRoom - Charge size bytes to the cache, then evict from the shards
+ *     in turn until the cached objects fit in MAX_CACHE_SIZE again. Only
+ *     one shard is locked at a time. Gives up once a whole round finds
+ *     every shard empty, the excess then belongs to inserts in flight.
+ *     Victims go to cache.evicted, outside the shard lock, before the
+ *     cache lets go of them.
+ */
+static void MakeRoom(size_t size)
+{
+    int empty_cnt = 0;
+
+    __atomic_add_fetch(&cache.size, size, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&cache.size, __ATOMIC_RELAXED) > MAX_CACHE_SIZE
+           && empty_cnt < CACHE_SHARDS)
+    {
+        unsigned int i = __atomic_fetch_add(&cache.evict_hand, 1, __ATOMIC_RELAXED);
+        CacheShard *shard = &cache.shards[i & (CACHE_SHARDS - 1)];
+
+        pthread_rwlock_wrlock(&shard->lock);
+        CacheEntry *victim = EvictVictim(shard);
+        pthread_rwlock_unlock(&shard->lock);
+
+        if (victim == NULL)
+        {
+            empty_cnt++;
+            continue;
+        }
+        empty_cnt = 0;
+        __atomic_sub_fetch(&cache.size, victim->obj_size, __ATOMIC_RELAXED);
+        if (cache.evicted != NULL)
+            cache.evicted(victim);
+        ReleaseCacheEntry(victim);
+    }
+}
+
+
+/*
+ * EvictVictim - Unlink the entry the cache policy picks from shard, or
+ *     return NULL if the shard is empty. Once unlinked no new reader can
+ *     pin the victim, and it is freed as soon as the readers still
+ *     sending it let go. Caller holds the lock of shard for writing.
+ */
+static CacheEntry *EvictVictim(CacheShard *shard)
+{
+    CacheEntry *victim = cache.policy->Victim(shard);
+
+    if (victim != NULL)
+    {
+        UnlinkEntry(shard, victim);
+        shard->evictions++;
+    }
+    return victim;
+}
+
+
+static void FreeEntry(CacheEntry *entry)
+{
+    Free(entry->uri);
+    Free(entry->obj);
+    Free(entry);
+}
@@ -0,0 +1,185 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/*
+ * Body bytes of each chunk an object larger than MAX_OBJECT_SIZE is
+ * cached in, each an entry of its own, see chunk.h
+ */
+#define CHUNK_SIZE 65536
+
+/* Initial buffer of a cache fill, doubled as the object grows */
+#define FILL_INIT_SIZE 8192
+
+/* Independently locked shards, and hash buckets in each, powers of 2 */
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256
+
+/* Counters per row of the W-TinyLFU frequency sketch, a power of 2 */
+#define SKETCH_WIDTH 1024
+#define SKETCH_ROWS 4
+
+/* States of a cache fill */
+#define FILL_PENDING 0
+#define FILL_PUBLISHED 1
+#define FILL_ABORTED 2
+
+
+/*
+ * A cached object, allocated to the size of its payload. obj holds the
+ * response head without the blank line and the headers that frame the
+ * body, which are written per client, then the decoded body. Only the
+ * bytes of obj are charged against MAX_CACHE_SIZE. An entry is never modified
+ * once it is linked, readers pin it with a reference instead of copying
+ * the object out, and it is freed when the last reference is dropped.
+ * The one exception is fresh_until, which a revalidation moves forward
+ * atomically. A changed object is cached in a new entry that replaces
+ * the old one. An object too large for one entry keeps only its head in
+ * obj, with chunked_size set, and its body in entries of CHUNK_SIZE
+ * bytes each. The fields below ref_cnt belong to the shard's eviction
+ * policy.
+ */
+typedef struct CacheEntry
+{
+    char *uri;
+    char *obj;
+    size_t obj_size;
+    size_t obj_cap;                 /* Bytes allocated while being filled */
+    size_t head_len;                /* Leading bytes of obj that are the
+                                       response head, less its framing */
+    size_t chunked_size;            /* Body bytes cached in chunks, or 0 */
+    size_t plain_size;              /* Body bytes before it was compressed,
+                                       0 if cached as received, see gzip.h */
+    size_t gzip_size;               /* Body bytes of its gzip variant, 0 if
+                                       it has none */
+    time_t fresh_until;             /* Served without asking the origin until
+                                       then, see fresh.h */
+    long lifetime;                  /* Seconds it was given to stay fresh */
+    long stale_window;              /* Seconds past fresh_until it may still
+                                       be served while refreshed */
+    unsigned long hits;             /* Lookups that found it */
+    unsigned long hash;
+    int ref_cnt;                    /* The cache holds one while linked */
+    int fill_state;                 /* Guarded by the shard's flight_mutex */
+    int on_disk;                    /* Read from the disk tier, which has it */
+
+    int referenced;                 /* CLOCK and SIEVE bit, set by hits */
+    int freq;                       /* LFU hit counter */
+    int segment;                    /* Policy queue the entry is on */
+    struct CacheEntry *older;
+    struct CacheEntry *newer;
+
+    struct CacheEntry *next;        /* Next entry in the bucket or flights */
+} CacheEntry;
+
+
+typedef struct
+{
+    CacheEntry *oldest;
+    CacheEntry *newest;
+    size_t size;                    /* Bytes of the objects queued */
+} CacheQueue;
+
+
+/*
+ * A shard owns the entries whose URI hashes to it. Lookups take its lock
+ * for reading, so hits run in parallel; inserts and evictions take it
+ * for writing and only stall lookups of the same shard. Fills still being
+ * fetched are listed in flights, so a miss on a URI already in flight
+ * waits for it instead of fetching it again. flight_mutex is taken before
+ * lock when both are held.
+ */
+typedef struct
+{
+    pthread_rwlock_t lock;
+    CacheEntry *buckets[CACHE_BUCKETS];
+
+    pthread_mutex_t flight_mutex;
+    pthread_cond_t flight_done;     /* Broadcast when a fill ends */
+    CacheEntry *flights;
+
+    /* Eviction policy state */
+    CacheQueue queues[3];
+    CacheEntry *hand;               /* SIEVE hand */
+    pthread_mutex_t promote_mutex;  /* LRU moves done by hits */
+    unsigned char *sketch;          /* W-TinyLFU access frequencies */
+    unsigned long sketch_adds;
+
+    /* Statistics */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long coalesced;        /* Misses served by another's fill */
+    unsigned long inserts;
+    unsigned long evictions;
+} __attribute__((aligned(64))) CacheShard;
+
+
+/*
+ * An eviction policy orders the entries of each shard. OnAccess and OnHit
+ * run under the shard's read lock, concurrently with other lookups, so
+ * they may only update an entry or the sketch with atomics or under
+ * promote_mutex. Init, OnInsert, Victim and Remove run under the write
+ * lock. Victim removes the entry it returns from the policy's queues,
+ * Remove takes off them an entry being replaced.
+ */
+typedef struct
+{
+    char *name;
+    void (*Init)(CacheShard *shard);
+    void (*OnAccess)(CacheShard *shard, unsigned long hash);
+    void (*OnHit)(CacheShard *shard, CacheEntry *entry);
+    void (*OnInsert)(CacheShard *shard, CacheEntry *entry);
+    CacheEntry *(*Victim)(CacheShard *shard);
+    void (*Remove)(CacheShard *shard, CacheEntry *entry);
+} CachePolicy;
+
+
+/* Called with each entry the cache evicts, which it may pin to keep */
+typedef void (*CacheEvictCallback)(CacheEntry *entry);
+
+
+typedef struct
+{
+    CacheShard shards[CACHE_SHARDS];
+    CachePolicy *policy;
+    CacheEvictCallback evicted;     /* NULL if no one is told */
+    size_t size;                    /* Bytes of all cached objects */
+    unsigned int evict_hand;        /* Shard to evict from next */
+} Cache;
+
+
+typedef struct
+{
+    char *policy;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long coalesced;
+    unsigned long inserts;
+    unsigned long evictions;
+    size_t size;
+} CacheStats;
+
+
+void InitCache(CachePolicy *policy, CacheEvictCallback evicted);
+CacheEntry *TryReadCache(char *uri);
+CacheEntry *ReadCacheOrFill(char *uri, CacheEntry **fill);
+CacheEntry *PollCacheOrFill(char *uri, CacheEntry **fill);
+CacheEntry *BeginCacheRefresh(CacheEntry *stale);
+CacheEntry *PinCacheEntry(CacheEntry *entry);
+void ReleaseCacheEntry(CacheEntry *entry);
+int ReserveCacheFill(CacheEntry *fill, size_t size);
+int AppendCacheFill(CacheEntry *fill, char *buf, size_t n);
+void PublishCacheFill(CacheEntry *fill);
+void AbortCacheFill(CacheEntry *fill);
+void GetCacheStats(CacheStats *stats);
+
+/* Built in policies, in policy.c */
+CachePolicy *FindCachePolicy(char *name);
+char *CachePolicyNames();
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,453 @@
+/*
+ * chunk.c - Objects too large for one cache entry, cached as their head
+ *     and a chunk entry per CHUNK_SIZE bytes of body, and the byte ranges
+ *     clients ask for, answered from either kind of entry. A chunk the
+ *     cache lost is fetched again on its own with a Range request, so a
+ *     large object is not fetched whole from the origin again.
+ */
+#define _GNU_SOURCE             /* strcasestr() */
+#include "chunk.h"
+#include "disk.h"
+#include "hash.h"
+#include "log.h"
+#include "origin.h"
+#include "proxy.h"
+
+
+static CacheEntry *ReadChunk(CacheEntry *entry, HttpSlice *host, long index);
+static int FetchChunk(char *uri, HttpSlice *host, CacheEntry *fill,
+                      long first, long last, long total);
+static int ReadChunkResponse(rio_t *rio, CacheEntry *fill,
+                             long first, long last, long total);
+
+
+static size_t chunked_max;          /* Largest object cached in chunks */
+
+
+/*
+ * InitChunks - Cache objects above MAX_OBJECT_SIZE and up to max_size in
+ *     chunks. Larger ones would only flush the cache.
+ */
+void InitChunks(size_t max_size)
+{
+    chunked_max = max_size;
+}
+
+
+/* IsChunkable - Whether a body of length bytes is cached in chunks */
+int IsChunkable(long length)
+{
+    return length > MAX_OBJECT_SIZE && length <= chunked_max;
+}
+
+
+/*
+ * ChunkKey - Write the cache key of chunk index of the object whose head
+ *     is cached in entry into out, CHUNK_KEY_SIZE bytes. A uri has no
+ *     space in it, so no key of a chunk is ever the uri of an object. The
+ *     key ends in a hash of the head, so once a changed object is cached
+ *     again its chunks are never mixed up with the old ones, which are
+ *     left for eviction.
+ */
+void ChunkKey(char *out, CacheEntry *entry, long index)
+{
+    unsigned long hash = HashBytes(FNV_OFFSET, entry->obj, entry->head_len);
+
+    sprintf(out, "%s chunk=%ld/%lx", entry->uri, index, hash);
+}
+
+
+/*
+ * ParseRange - Parse the value of a Range header into range. Returns 1
+ *     if it holds a single byte range, 0 otherwise, which is answered
+ *     with the whole body as if there were no header.
+ */
+int ParseRange(char *value, ByteRange *range)
+{
+    char *p = value, *end;
+    long first = -1, last = -1;
+
+    range->set = 0;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (strncasecmp(p, "bytes=", 6) || strchr(p, ',') != NULL)
+        return 0;
+    p += 6;
+
+    if (isdigit(*p))
+    {
+        first = strtol(p, &end, 10);
+        p = end;
+    }
+    if (*p++ != '-')
+        return 0;
+    if (isdigit(*p))
+    {
+        last = strtol(p, &end, 10);
+        p = end;
+    }
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+
+    if (*p != '\0' || (first < 0 && last < 0) || (first >= 0 && last >= 0 && last < first))
+        return 0;
+    range->set = 1;
+    range->first = first;
+    range->last = last;
+    return 1;
+}
+
+
+/*
+ * ResolveRange - Fit range to a body of total bytes, leaving first and
+ *     last the offsets of its first and last byte. Returns RANGE_PARTIAL
+ *     if that is a part of the body, RANGE_WHOLE if there is no range,
+ *     and RANGE_UNSATISFIABLE if the range misses the body.
+ */
+int ResolveRange(ByteRange *range, long total)
+{
+    if (!range->set)
+        return RANGE_WHOLE;
+
+    if (range->first < 0)
+    {
+        if (range->last == 0 || total == 0)
+            return RANGE_UNSATISFIABLE;
+        range->first = range->last >= total ? 0 : total - range->last;
+        range->last = total - 1;
+    }
+    else
+    {
+        if (range->first >= total)
+            return RANGE_UNSATISFIABLE;
+        if (range->last < 0 || range->last >= total)
+            range->last = total - 1;
+    }
+    return RANGE_PARTIAL;
+}
+
+
+/*
+ * FormatRangeHead - Point iov[0..2] at the head answering range from the
+ *     cached head of entry, for a body of total bytes: the cached head as
+ *     is without a range, the head of a 206 with its Content-Range for
+ *     one, a bare 416 for a range that misses the body. The lines not
+ *     cached are written into buf, of 2 * MAXLINE bytes. Only a cached
+ *     200 honours a range. Returns what ResolveRange returns.
+ */
+int FormatRangeHead(struct iovec *iov, char *buf, CacheEntry *entry,
+                    ByteRange *range, long total, int keep_alive)
+{
+    char *eol = memchr(entry->obj, '\n', entry->head_len);
+    char *status_line = buf, *framing = buf + MAXLINE;
+    int status = 0;
+
+    if (eol != NULL && eol - entry->obj < MAXLINE)
+    {
+        memcpy(status_line, entry->obj, eol - entry->obj);
+        status_line[eol - entry->obj] = '\0';
+        sscanf(status_line, "HTTP/1.%*d %d", &status);
+    }
+    int rc = status == 200 ? ResolveRange(range, total) : RANGE_WHOLE;
+
+    if (rc == RANGE_WHOLE)
+    {
+        iov[0].iov_base = entry->obj;
+        iov[0].iov_len = entry->head_len;
+        iov[1].iov_base = NULL;
+        iov[1].iov_len = 0;
+        iov[2].iov_base = framing;
+        iov[2].iov_len = FormatFraming(framing, total, keep_alive);
+    }
+    else if (rc == RANGE_PARTIAL)
+    {
+        /* The cached headers follow a status line of our own */
+        iov[0].iov_base = status_line;
+        iov[0].iov_len = sprintf(status_line, "%.8s 206 Partial Content\r\n", entry->obj);
+        iov[1].iov_base = eol + 1;
+        iov[1].iov_len = entry->head_len - (eol + 1 - entry->obj);
+        size_t n = sprintf(framing, "Content-Range: bytes %ld-%ld/%ld\r\n",
+                           range->first, range->last, total);
+        iov[2].iov_base = framing;
+        iov[2].iov_len = n + FormatFraming(framing + n, range->last - range->first + 1,
+                                           keep_alive);
+    }
+    else
+    {
+        iov[0].iov_base = status_line;
+        iov[0].iov_len = sprintf(status_line, "%.8s 416 Range Not Satisfiable\r\n", entry->obj);
+        iov[1].iov_base = NULL;
+        iov[1].iov_len = 0;
+        size_t n = sprintf(framing, "Content-Range: bytes */%ld\r\n", total);
+        iov[2].iov_base = framing;
+        iov[2].iov_len = n + FormatFraming(framing + n, 0, keep_alive);
+    }
+    return rc;
+}
+
+
+/*
+ * SendChunkedEntry - Send the object whose head is entry, or the range of
+ *     it the client asked for, to connfd. The chunks the range covers are
+ *     read in turn from the cache, the disk tier or the origin, where
+ *     host is the client's Host header to ask with. Returns the bytes
+ *     sent, or -1 if the client went away or a chunk could not be had.
+ */
+long SendChunkedEntry(int connfd, CacheEntry *entry, HttpSlice *host,
+                      ByteRange *range, int keep_alive)
+{
+    char buf[2 * MAXLINE];
+    struct iovec iov[3];
+    long total = entry->chunked_size;
+    long first = 0, last = total - 1;
+
+    int rc = FormatRangeHead(iov, buf, entry, range, total, keep_alive);
+    if (rc == RANGE_PARTIAL)
+    {
+        first = range->first;
+        last = range->last;
+    }
+    else if (rc == RANGE_UNSATISFIABLE)
+    {
+        last = -1;
+    }
+
+    long sent = WritevAll(connfd, iov, 3);
+    if (sent < 0)
+        return -1;
+
+    for (long index = first / CHUNK_SIZE; index * CHUNK_SIZE <= last; index++)
+    {
+        CacheEntry *chunk = ReadChunk(entry, host, index);
+        if (chunk == NULL)
+            return -1;
+
+        long start = index * CHUNK_SIZE;
+        long from = first > start ? first - start : 0;
+        long to = last < start + CHUNK_SIZE ? last - start : CHUNK_SIZE - 1;
+        int n = rio_writen(connfd, chunk->obj + from, to - from + 1);
+        ReleaseCacheEntry(chunk);
+        if (n < 0)
+            return -1;
+        sent += to - from + 1;
+    }
+    return sent;
+}
+
+
+/*
+ * RelayChunks - Answer the client from a response for the large object
+ *     whose head entry was just cached, the body of which follows on
+ *     server_rio: the head, then the range asked for, or all of the body.
+ *     Each chunk read is cached and published as it completes, unless it
+ *     is cached already or another client is reading it in. The body is
+ *     only read up to the chunk ending the range, the rest is fetched by
+ *     range when asked for. Returns 0 if the body was read to its end, 1
+ *     if the rest was left unread, -1 on error.
+ */
+int RelayChunks(rio_t *server_rio, int connfd, CacheEntry *entry,
+                ByteRange *range, int keep_alive)
+{
+    char buf[2 * MAXLINE], key[CHUNK_KEY_SIZE];
+    char copy[CHUNK_SIZE];          /* A chunk that is not cached */
+    struct iovec iov[3];
+    long total = entry->chunked_size;
+    long first = 0, last = total - 1;
+
+    int rc = FormatRangeHead(iov, buf, entry, range, total, keep_alive);
+    if (rc == RANGE_PARTIAL)
+    {
+        first = range->first;
+        last = range->last;
+    }
+    else if (rc == RANGE_UNSATISFIABLE)
+    {
+        last = -1;
+    }
+    if (WritevAll(connfd, iov, 3) < 0)
+        return -1;
+
+    for (long index = 0; index * CHUNK_SIZE <= last; index++)
+    {
+        long start = index * CHUNK_SIZE;
+        long len = total - start < CHUNK_SIZE ? total - start : CHUNK_SIZE;
+        CacheEntry *chunk, *fill;
+        char *data = copy;
+
+        ChunkKey(key, entry, index);
+        if ((chunk = PollCacheOrFill(key, &fill)) != NULL)
+            ReleaseCacheEntry(chunk);
+        chunk = NULL;
+        if (fill != NULL)
+        {
+            ReserveCacheFill(fill, len);    /* A chunk always fits */
+            data = fill->obj;
+        }
+
+        if (rio_readnb(server_rio, data, len) != len)
+        {
+            if (fill != NULL)
+                AbortCacheFill(fill);
+            return -1;
+        }
+        if (fill != NULL)
+        {
+            fill->obj_size = len;
+            chunk = PinCacheEntry(fill);
+            PublishCacheFill(fill);
+        }
+
+        long from = first > start ? first - start : 0;
+        long to = last < start + len ? last - start : len - 1;
+        int n = from <= to ? rio_writen(connfd, data + from, to - from + 1) : 0;
+        if (chunk != NULL)
+            ReleaseCacheEntry(chunk);
+        if (n < 0)
+            return -1;
+    }
+    return last < total - 1 ? 1 : 0;
+}
+
+
+/*
+ * ReadChunk - Return chunk index of the object whose head is cached in
+ *     entry, pinned. A chunk another client is reading in is waited for;
+ *     one neither cached nor on disk is fetched from the origin. Returns
+ *     NULL if it could not be had.
+ */
+static CacheEntry *ReadChunk(CacheEntry *entry, HttpSlice *host, long index)
+{
+    char key[CHUNK_KEY_SIZE], *uri = entry->uri;
+    long total = entry->chunked_size;
+    long first = index * CHUNK_SIZE;
+    long len = total - first < CHUNK_SIZE ? total - first : CHUNK_SIZE;
+    CacheEntry *chunk = NULL, *fill;
+
+    ChunkKey(key, entry, index);
+
+    /* The fill of another client being aborted leaves us none, so retry */
+    for (int tries = 0; tries < 2 && chunk == NULL; tries++)
+    {
+        if ((chunk = ReadCacheOrFill(key, &fill)) != NULL || fill == NULL)
+            continue;
+        if (ReadDiskCache(fill) < 0
+            && FetchChunk(uri, host, fill, first, first + len - 1, total) < 0)
+        {
+            AbortCacheFill(fill);
+            return NULL;
+        }
+        chunk = PinCacheEntry(fill);
+        PublishCacheFill(fill);
+    }
+
+    if (chunk != NULL && chunk->obj_size != len)
+    {
+        LOG(LOG_WARN, "chunk %ld of %s has %lu bytes, not %ld",
+            index, uri, chunk->obj_size, len);
+        ReleaseCacheEntry(chunk);
+        return NULL;
+    }
+    return chunk;
+}
+
+
+/*
+ * FetchChunk - Read bytes first to last of the object of uri, total bytes
+ *     long, into fill with a Range request over a pooled connection to
+ *     its origin. Returns 0 if fill holds them, -1 otherwise.
+ */
+static int FetchChunk(char *uri, HttpSlice *host, CacheEntry *fill,
+                      long first, long last, long total)
+{
+    char range[MAXLINE];
+    HttpSlice target = { uri, strlen(uri) };
+    URI uri_data;
+    HttpBuilder request;
+    rio_t rio;
+    int serverfd, reused, rc;
+
+    if (ParseUri(target, &uri_data) < 0)
+        return -1;
+    sprintf(range, "Range: bytes=%ld-%ld\r\n", first, last);
+    BuildServerRequest(&request, &uri_data, host, 1, range);
+    LOG(LOG_DEBUG, "Fetch bytes %ld-%ld of %s", first, last, uri);
+
+    while ((serverfd = AcquireOrigin(uri_data.host, uri_data.port, 1, &reused)) >= 0)
+    {
+        Rio_readinitb(&rio, serverfd);
+        if (WritevAll(serverfd, request.iov, request.cnt) < 0)
+            rc = RELAY_NO_RESPONSE;
+        else
+            rc = ReadChunkResponse(&rio, fill, first, last, total);
+
+        if (rc == RELAY_KEEP)
+        {
+            ReleaseOrigin(uri_data.host, uri_data.port, serverfd);
+            return 0;
+        }
+        DropOrigin(uri_data.host, uri_data.port, serverfd);
+        if (rc != RELAY_NO_RESPONSE || !reused)
+            return rc == RELAY_DONE ? 0 : -1;
+    }
+    return -1;
+}
+
+
+/*
+ * ReadChunkResponse - Read the 206 answering the request for bytes first
+ *     to last of an object of total bytes into fill. Any other answer,
+ *     such as the whole body from an origin ignoring the range, or a
+ *     total other than the cached one, as the object changed since,
+ *     fails the fetch. Returns one of the RELAY_ results.
+ */
+static int ReadChunkResponse(rio_t *rio, CacheEntry *fill,
+                             long first, long last, long total)
+{
+    char line[MAXLINE];
+    long length = -1, range_first = -1, range_last = -1, range_total = -1;
+    int minor = 0, status = 0;
+
+    ssize_t n = rio_readlineb(rio, line, MAXLINE);
+    if (n <= 0)
+        return n < 0 && errno == EAGAIN ? RELAY_TIMEOUT : RELAY_NO_RESPONSE;
+    sscanf(line, "HTTP/1.%d %d", &minor, &status);
+    int keep = (minor >= 1);
+
+    while (1)
+    {
+        if (rio_readlineb(rio, line, MAXLINE) <= 0)
+            return RELAY_ERROR;
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n"))
+            break;
+
+        if (!strncasecmp(line, "Content-Length:", 15))
+        {
+            length = strtol(line + 15, NULL, 10);
+        }
+        else if (!strncasecmp(line, "Content-Range:", 14))
+        {
+            sscanf(line + 14, " bytes %ld-%ld/%ld", &range_first, &range_last, &range_total);
+        }
+        else if (!strncasecmp(line, "Connection:", 11))
+        {
+            if (strcasestr(line + 11, "close"))
+                keep = 0;
+            else if (strcasestr(line + 11, "keep-alive"))
+                keep = 1;
+        }
+    }
+
+    if (status != 206 || range_first != first || range_last != last
+        || range_total != total || length != last - first + 1)
+    {
+        LOG(LOG_WARN, "Range fetch of %s: status %d, bytes %ld-%ld/%ld",
+            fill->uri, status, range_first, range_last, range_total);
+        return RELAY_ERROR;
+    }
+
+    ReserveCacheFill(fill, length);     /* A chunk always fits */
+    if (rio_readnb(rio, fill->obj, length) != length)
+        return RELAY_ERROR;
+    fill->obj_size = length;
+    return keep ? RELAY_KEEP : RELAY_DONE;
+}
@@ -0,0 +1,44 @@
+#ifndef __CHUNK_H__
+#define __CHUNK_H__
+
+#include <sys/uio.h>
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+
+/* Room for the cache key of a chunk, a uri, the chunk's index and a hash */
+#define CHUNK_KEY_SIZE (MAXLINE + 64)
+
+/* Results of ResolveRange */
+#define RANGE_UNSATISFIABLE -1
+#define RANGE_WHOLE 0           /* No range, the whole body is sent */
+#define RANGE_PARTIAL 1
+
+
+/*
+ * The byte range of a Range header, only a single one is honoured. A
+ * suffix range, the last n bytes, has first -1 and last n until it is
+ * resolved against the body's length.
+ */
+typedef struct
+{
+    int set;                        /* 0 if there was no usable range */
+    long first;
+    long last;                      /* -1 for up to the end */
+} ByteRange;
+
+
+void InitChunks(size_t max_size);
+int IsChunkable(long length);
+void ChunkKey(char *out, CacheEntry *entry, long index);
+int ParseRange(char *value, ByteRange *range);
+int ResolveRange(ByteRange *range, long total);
+int FormatRangeHead(struct iovec *iov, char *buf, CacheEntry *entry,
+                    ByteRange *range, long total, int keep_alive);
+long SendChunkedEntry(int connfd, CacheEntry *entry, HttpSlice *host,
+                      ByteRange *range, int keep_alive);
+int RelayChunks(rio_t *server_rio, int connfd, CacheEntry *entry,
+                ByteRange *range, int keep_alive);
+
+#endif /* __CHUNK_H__ */
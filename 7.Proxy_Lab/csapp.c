@@ -42,7 +42,7 @@ void posix_error(int code, char *msg) /* Posix-style error */
     exit(0);
 }
 
-void gai_error(int code, char *msg) /* Getaddrinfo-style error */
+void getaddrinfo_error(int code, char *msg) /* Getaddrinfo-style error */
 {
     fprintf(stderr, "%s: %s\n", msg, gai_strerror(code));
     exit(0);
@@ -605,7 +605,7 @@ void Getaddrinfo(const char *node, const char *service,
     int rc;
 
     if ((rc = getaddrinfo(node, service, hints, res)) != 0) 
-        gai_error(rc, "Getaddrinfo error");
+        getaddrinfo_error(rc, "Getaddrinfo error");
 }
 /* $end getaddrinfo */
 
@@ -616,7 +616,7 @@ void Getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host,
 
     if ((rc = getnameinfo(sa, salen, host, hostlen, serv, 
                           servlen, flags)) != 0) 
-        gai_error(rc, "Getnameinfo error");
+        getaddrinfo_error(rc, "Getnameinfo error");
 }
 
 void Freeaddrinfo(struct addrinfo *res)
@@ -830,6 +830,26 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 }
 /* $end rio_read */
 
+/*
+ * rio_fill - Refill the internal buffer if it is empty. Returns the
+ *    number of unread bytes in it, 0 on EOF, -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR) /* Interrupted by sig handler return */
+                return -1;
+        }
+        else if (rp->rio_cnt == 0)  /* EOF */
+            return 0;
+        else
+            rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    }
+    return rp->rio_cnt;
+}
+
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
@@ -865,34 +885,65 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The line is
+ *    located with memchr() over the internal buffer instead of being
+ *    copied out one byte at a time.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *eol = NULL;
+
+    while (n < maxlen - 1 && eol == NULL) {
+        if ((rc = rio_fill(rp)) < 0)
+            return -1;    /* Error */
+        else if (rc == 0)
+            break;        /* EOF */
+
+        cnt = rp->rio_cnt;
+        if (cnt > maxlen - 1 - n)
+            cnt = maxlen - 1 - n;
+        if ((eol = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+            cnt = eol - rp->rio_bufptr + 1;
+
+        memcpy(bufp, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        bufp += cnt;
+        n += cnt;
     }
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readsomeb - Read up to n bytes, whatever is available (buffered).
+ *    Unread bytes of the internal buffer are returned first, otherwise a
+ *    single read() goes straight into usrbuf, so large blocks are not
+ *    staged through the internal buffer. Returns 0 on EOF.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t cnt;
+
+    if (rp->rio_cnt > 0) {
+        cnt = rp->rio_cnt < n ? rp->rio_cnt : n;
+        memcpy(usrbuf, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        return cnt;
+    }
+
+    while ((cnt = read(rp->rio_fd, usrbuf, n)) < 0) {
+        if (errno != EINTR) /* Interrupted by sig handler return */
+            return -1;
+    }
+    return cnt;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -934,6 +985,15 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readsomeb(rp, usrbuf, n)) < 0)
+	unix_error("Rio_readsomeb error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -0,0 +1,520 @@
+/*
+ * disk.c - Second cache tier on disk, behind the memory cache. Objects
+ *     the memory cache evicts are appended by a writer thread to segment
+ *     logs in the directory given with -d, and indexed in memory by uri.
+ *     A memory miss reads the object back with pread into the pending
+ *     fill, which is then published to memory like a fetched one. On
+ *     start the index is rebuilt from the record headers of the logs, so
+ *     a restarted proxy is warm again at once.
+ */
+#include <dirent.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+#include "hash.h"
+#include "log.h"
+
+
+static void *Writer(void *vargp);
+static int WriteRecord(CacheEntry *entry, unsigned long checksum);
+static int IsOnDisk(CacheEntry *entry, unsigned long checksum);
+static DiskSegment *OpenSegment(int id, int flags);
+static DiskSegment *RollSegment();
+static void ScanSegment(DiskSegment *seg);
+static void IndexRecord(char *uri, DiskSegment *seg, off_t offset, DiskRecord *rec);
+static DiskEntry *FindDiskEntry(char *uri, unsigned long hash);
+static void RemoveDiskEntries(char *uri, DiskSegment *seg);
+static void ReleaseSegment(DiskSegment *seg);
+static int CompareIds(const void *a, const void *b);
+
+
+static char *disk_dir;              /* NULL while the tier is off */
+
+/* The index and the segment list */
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static DiskEntry *buckets[DISK_BUCKETS];
+static unsigned long object_cnt;
+static DiskSegment *oldest, *newest;
+static int segment_cnt;
+
+/* Evicted objects waiting for the writer */
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static DiskJob *jobs_head, *jobs_tail;
+static size_t queued_bytes;
+
+static unsigned long hits, misses, writes, dropped;
+
+
+/*
+ * InitDiskCache - Turn the tier on, keeping it in dir, which is created
+ *     if need be. Rebuilds the index from the segments already there.
+ */
+void InitDiskCache(char *dir)
+{
+    int *ids = NULL, id_cnt = 0;
+    struct dirent *de;
+    pthread_t tid;
+    DIR *d;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        unix_error("mkdir error");
+    if ((d = opendir(dir)) == NULL)
+        unix_error("opendir error");
+    disk_dir = dir;
+
+    while ((de = readdir(d)) != NULL)
+    {
+        int id;
+        char tail;
+        if (sscanf(de->d_name, "cache.%d.lo%c", &id, &tail) != 2 || tail != 'g')
+            continue;
+        ids = Realloc(ids, (id_cnt + 1) * sizeof(int));
+        ids[id_cnt++] = id;
+    }
+    closedir(d);
+    qsort(ids, id_cnt, sizeof(int), CompareIds);
+
+    for (int i = 0; i < id_cnt; i++)
+    {
+        DiskSegment *seg = OpenSegment(ids[i], 0);
+        if (seg == NULL)
+            continue;
+        if (newest != NULL)
+            newest->newer = seg;
+        else
+            oldest = seg;
+        newest = seg;
+        segment_cnt++;
+        ScanSegment(seg);
+    }
+    if (ids != NULL)
+        Free(ids);
+
+    if (newest == NULL)
+    {
+        if ((oldest = newest = OpenSegment(0, O_TRUNC)) == NULL)
+            unix_error("open error");
+        segment_cnt = 1;
+    }
+
+    LOG(LOG_INFO, "disk cache %s: %lu objects in %d segments",
+        dir, object_cnt, segment_cnt);
+    Pthread_create(&tid, NULL, Writer, NULL);
+}
+
+
+/*
+ * SpillToDisk - Called by the memory cache with each entry it evicts.
+ *     Queues the entry, pinned, for the writer, or drops it if the writer
+ *     is DISK_QUEUE_MAX behind, so evicting never waits for the disk.
+ *     Entries read from disk are already there.
+ */
+void SpillToDisk(CacheEntry *entry)
+{
+    if (entry->on_disk)
+        return;
+
+    DiskJob *job = Malloc(sizeof(DiskJob));
+
+    pthread_mutex_lock(&jobs_mutex);
+    if (queued_bytes + entry->obj_size > DISK_QUEUE_MAX)
+    {
+        pthread_mutex_unlock(&jobs_mutex);
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        Free(job);
+        return;
+    }
+
+    job->entry = PinCacheEntry(entry);
+    job->next = NULL;
+    if (jobs_tail != NULL)
+        jobs_tail->next = job;
+    else
+        jobs_head = job;
+    jobs_tail = job;
+    queued_bytes += entry->obj_size;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+
+/*
+ * ReadDiskCache - Read the object cached on disk for the uri of fill, a
+ *     pending fill, into it. Returns 0 if it did and fill is complete, or
+ *     -1 if the object is not on disk, or not intact, with fill as it was.
+ */
+int ReadDiskCache(CacheEntry *fill)
+{
+    if (disk_dir == NULL)
+        return -1;
+
+    pthread_rwlock_rdlock(&index_lock);
+    DiskEntry *d = FindDiskEntry(fill->uri, HashString(fill->uri));
+    if (d == NULL)
+    {
+        pthread_rwlock_unlock(&index_lock);
+        __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    DiskSegment *seg = d->segment;
+    off_t offset = d->offset;
+    size_t size = d->obj_size;
+    size_t head_len = d->head_len;
+    size_t chunked_size = d->chunked_size;
+    size_t plain_size = d->plain_size;
+    size_t gzip_size = d->gzip_size;
+    time_t fresh_until = d->fresh_until;
+    long lifetime = d->lifetime;
+    long stale_window = d->stale_window;
+    unsigned long checksum = d->checksum;
+    __atomic_add_fetch(&seg->ref_cnt, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&index_lock);
+
+    size_t got = 0;
+    if (ReserveCacheFill(fill, size))
+    {
+        while (got < size)
+        {
+            ssize_t n = pread(seg->fd, fill->obj + got, size - got, offset + got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            got += n;
+        }
+    }
+
+    int rc = -1;
+    if (got == size && HashWords(fill->obj, size) == checksum)
+    {
+        fill->obj_size = size;
+        fill->head_len = head_len;
+        fill->chunked_size = chunked_size;
+        fill->plain_size = plain_size;
+        fill->gzip_size = gzip_size;
+        fill->fresh_until = fresh_until;
+        fill->lifetime = lifetime;
+        fill->stale_window = stale_window;
+        fill->on_disk = 1;
+        __atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+        rc = 0;
+    }
+    else
+    {
+        LOG(LOG_WARN, "disk cache: bad copy of %s in segment %d", fill->uri, seg->id);
+        RemoveDiskEntries(fill->uri, seg);
+        __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+    }
+    ReleaseSegment(seg);
+    return rc;
+}
+
+
+/* GetDiskStats - Fill in stats and return 1, or return 0 if the tier is off */
+int GetDiskStats(DiskStats *stats)
+{
+    memset(stats, 0, sizeof(DiskStats));
+    if (disk_dir == NULL)
+        return 0;
+
+    pthread_rwlock_rdlock(&index_lock);
+    stats->objects = object_cnt;
+    stats->segments = segment_cnt;
+    for (DiskSegment *seg = oldest; seg != NULL; seg = seg->newer)
+        stats->bytes += seg->size;
+    pthread_rwlock_unlock(&index_lock);
+
+    stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+    stats->writes = __atomic_load_n(&writes, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+/*
+ * Writer - Append the queued objects to the newest segment, skipping
+ *     those the disk already has the same copy of, such as an object
+ *     fetched again unchanged.
+ */
+static void *Writer(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        pthread_mutex_lock(&jobs_mutex);
+        while (jobs_head == NULL)
+            pthread_cond_wait(&jobs_cond, &jobs_mutex);
+        DiskJob *job = jobs_head;
+        if ((jobs_head = job->next) == NULL)
+            jobs_tail = NULL;
+        queued_bytes -= job->entry->obj_size;
+        pthread_mutex_unlock(&jobs_mutex);
+
+        CacheEntry *entry = job->entry;
+        unsigned long checksum = HashWords(entry->obj, entry->obj_size);
+        if (!IsOnDisk(entry, checksum) && WriteRecord(entry, checksum) == 0)
+            __atomic_add_fetch(&writes, 1, __ATOMIC_RELAXED);
+        ReleaseCacheEntry(entry);
+        Free(job);
+    }
+    return NULL;
+}
+
+
+/*
+ * WriteRecord - Append entry to the newest segment, rolling over to a new
+ *     one once it holds its share of DISK_CACHE_SIZE, and index it.
+ *     Returns -1 if it could not be written.
+ */
+static int WriteRecord(CacheEntry *entry, unsigned long checksum)
+{
+    DiskSegment *seg = newest;      /* Only the writer changes newest */
+    DiskRecord rec = { DISK_MAGIC, strlen(entry->uri), entry->head_len,
+                       entry->obj_size, checksum, entry->chunked_size,
+                       entry->plain_size, entry->gzip_size,
+                       __atomic_load_n(&entry->fresh_until, __ATOMIC_RELAXED),
+                       entry->lifetime, entry->stale_window };
+    size_t len = sizeof(DiskRecord) + rec.uri_len + rec.obj_size;
+
+    if (seg->size > 0 && seg->size + len > DISK_CACHE_SIZE / DISK_SEGMENTS
+        && (seg = RollSegment()) == NULL)
+        return -1;
+
+    struct iovec iov[3] = {
+        { &rec, sizeof(DiskRecord) },
+        { entry->uri, rec.uri_len },
+        { entry->obj, rec.obj_size },
+    };
+    ssize_t n = writev(seg->fd, iov, 3);
+    if (n != len)
+    {
+        /* Leave no torn record behind for the next one to follow */
+        LOG(LOG_ERROR, "disk cache: write error: %s", n < 0 ? strerror(errno) : "short");
+        if (n > 0 && ftruncate(seg->fd, seg->size) < 0)
+            LOG(LOG_ERROR, "disk cache: truncate error: %s", strerror(errno));
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&index_lock);
+    IndexRecord(entry->uri, seg, seg->size + sizeof(DiskRecord) + rec.uri_len, &rec);
+    seg->size += len;
+    pthread_rwlock_unlock(&index_lock);
+    return 0;
+}
+
+
+static int IsOnDisk(CacheEntry *entry, unsigned long checksum)
+{
+    pthread_rwlock_rdlock(&index_lock);
+    DiskEntry *d = FindDiskEntry(entry->uri, HashString(entry->uri));
+    int same = d != NULL && d->obj_size == entry->obj_size
+        && d->head_len == entry->head_len && d->checksum == checksum
+        && d->chunked_size == entry->chunked_size;
+    pthread_rwlock_unlock(&index_lock);
+    return same;
+}
+
+
+static DiskSegment *OpenSegment(int id, int flags)
+{
+    char path[MAXLINE];
+    int fd;
+
+    snprintf(path, MAXLINE, "%s/cache.%d.log", disk_dir, id);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND | flags, 0644)) < 0)
+    {
+        LOG(LOG_ERROR, "disk cache: cannot open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    DiskSegment *seg = Calloc(1, sizeof(DiskSegment));
+    seg->id = id;
+    seg->fd = fd;
+    seg->ref_cnt = 1;
+    return seg;
+}
+
+
+/*
+ * RollSegment - Start a new newest segment, and drop the oldest ones with
+ *     their objects while there are more than DISK_SEGMENTS. Returns the
+ *     new segment, or NULL if it could not be created.
+ */
+static DiskSegment *RollSegment()
+{
+    DiskSegment *seg = OpenSegment(newest->id + 1, O_TRUNC);
+    DiskSegment *dropped_segs = NULL;
+
+    if (seg == NULL)
+        return NULL;
+
+    pthread_rwlock_wrlock(&index_lock);
+    newest->newer = seg;
+    newest = seg;
+    segment_cnt++;
+    while (segment_cnt > DISK_SEGMENTS)
+    {
+        DiskSegment *drop = oldest;
+        oldest = drop->newer;
+        segment_cnt--;
+        RemoveDiskEntries(NULL, drop);
+        drop->newer = dropped_segs;
+        dropped_segs = drop;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    while (dropped_segs != NULL)
+    {
+        char path[MAXLINE];
+        DiskSegment *drop = dropped_segs;
+
+        dropped_segs = drop->newer;
+        snprintf(path, MAXLINE, "%s/cache.%d.log", disk_dir, drop->id);
+        unlink(path);
+        ReleaseSegment(drop);
+    }
+    return seg;
+}
+
+
+/*
+ * ScanSegment - Index the records of seg, at start. A record cut short by
+ *     a crash ends the segment, which is truncated before it.
+ */
+static void ScanSegment(DiskSegment *seg)
+{
+    off_t end = lseek(seg->fd, 0, SEEK_END);
+    off_t off = 0;
+    char uri[MAXLINE];
+    DiskRecord rec;
+
+    while (off + (off_t) sizeof(DiskRecord) <= end)
+    {
+        if (pread(seg->fd, &rec, sizeof(DiskRecord), off) != sizeof(DiskRecord))
+            break;
+        if (rec.magic != DISK_MAGIC || rec.uri_len == 0 || rec.uri_len >= MAXLINE
+            || rec.obj_size > MAX_OBJECT_SIZE || rec.head_len > rec.obj_size)
+            break;
+
+        off_t next = off + sizeof(DiskRecord) + rec.uri_len + rec.obj_size;
+        if (next > end)
+            break;
+        if (pread(seg->fd, uri, rec.uri_len, off + sizeof(DiskRecord)) != rec.uri_len)
+            break;
+        uri[rec.uri_len] = '\0';
+
+        IndexRecord(uri, seg, off + sizeof(DiskRecord) + rec.uri_len, &rec);
+        off = next;
+    }
+
+    if (off < end)
+    {
+        LOG(LOG_WARN, "disk cache: segment %d cut at %ld of %ld bytes",
+            seg->id, (long) off, (long) end);
+        if (ftruncate(seg->fd, off) < 0)
+            unix_error("ftruncate error");
+    }
+    seg->size = off;
+}
+
+
+/*
+ * IndexRecord - Point the index entry of uri at the record rec, whose
+ *     object is at offset in seg. Caller holds index_lock for writing.
+ */
+static void IndexRecord(char *uri, DiskSegment *seg, off_t offset, DiskRecord *rec)
+{
+    unsigned long hash = HashString(uri);
+    DiskEntry *d = FindDiskEntry(uri, hash);
+
+    if (d == NULL)
+    {
+        DiskEntry **bucket = &buckets[hash & (DISK_BUCKETS - 1)];
+
+        d = Malloc(sizeof(DiskEntry));
+        d->uri = Malloc(rec->uri_len + 1);
+        strcpy(d->uri, uri);
+        d->hash = hash;
+        d->next = *bucket;
+        *bucket = d;
+        object_cnt++;
+    }
+    d->segment = seg;
+    d->offset = offset;
+    d->head_len = rec->head_len;
+    d->obj_size = rec->obj_size;
+    d->checksum = rec->checksum;
+    d->chunked_size = rec->chunked_size;
+    d->plain_size = rec->plain_size;
+    d->gzip_size = rec->gzip_size;
+    d->fresh_until = rec->fresh_until;
+    d->lifetime = rec->lifetime;
+    d->stale_window = rec->stale_window;
+}
+
+
+/* Caller holds index_lock */
+static DiskEntry *FindDiskEntry(char *uri, unsigned long hash)
+{
+    DiskEntry *d = buckets[hash & (DISK_BUCKETS - 1)];
+
+    while (d != NULL && (d->hash != hash || strcmp(d->uri, uri)))
+        d = d->next;
+    return d;
+}
+
+
+/*
+ * RemoveDiskEntries - Drop the index entries that point into seg, only
+ *     the one of uri unless uri is NULL. Caller holds index_lock for
+ *     writing if uri is NULL, else it must not hold it at all.
+ */
+static void RemoveDiskEntries(char *uri, DiskSegment *seg)
+{
+    int first = 0, last = DISK_BUCKETS - 1;
+
+    if (uri != NULL)
+    {
+        pthread_rwlock_wrlock(&index_lock);
+        first = last = HashString(uri) & (DISK_BUCKETS - 1);
+    }
+
+    for (int i = first; i <= last; i++)
+    {
+        DiskEntry **link = &buckets[i];
+        while (*link != NULL)
+        {
+            DiskEntry *d = *link;
+            if (d->segment != seg || (uri != NULL && strcmp(d->uri, uri)))
+            {
+                link = &d->next;
+                continue;
+            }
+            *link = d->next;
+            object_cnt--;
+            Free(d->uri);
+            Free(d);
+        }
+    }
+
+    if (uri != NULL)
+        pthread_rwlock_unlock(&index_lock);
+}
+
+
+static void ReleaseSegment(DiskSegment *seg)
+{
+    if (__atomic_sub_fetch(&seg->ref_cnt, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        close(seg->fd);
+        Free(seg);
+    }
+}
+
+
+static int CompareIds(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
@@ -0,0 +1,101 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Bytes the disk tier may hold, spread over DISK_SEGMENTS log files */
+#define DISK_CACHE_SIZE (1L << 30)
+#define DISK_SEGMENTS 8
+
+/* Hash buckets of the index, a power of 2 */
+#define DISK_BUCKETS 65536
+
+/* Bytes of evicted objects waiting for the writer, past which more are dropped */
+#define DISK_QUEUE_MAX (8 * MAX_CACHE_SIZE)
+
+#define DISK_MAGIC 0x36787270   /* "prx6" */
+
+
+/*
+ * A record of a segment log: this header, the uri, then the object as
+ * cached, head_len bytes of response head and the body.
+ */
+typedef struct
+{
+    unsigned int magic;
+    unsigned int uri_len;
+    unsigned int head_len;
+    unsigned int obj_size;
+    unsigned long checksum;         /* Of the object */
+    unsigned long chunked_size;     /* Of a head whose body is in chunks */
+    unsigned long plain_size;       /* Of a compressed body */
+    unsigned long gzip_size;        /* Of the gzip variant of the body */
+    long fresh_until;               /* As when the object was written */
+    long lifetime;
+    long stale_window;
+} DiskRecord;
+
+
+/*
+ * A segment log, appended to by the writer until it holds its share of
+ * DISK_CACHE_SIZE. Once there are more than DISK_SEGMENTS, the oldest is
+ * dropped whole with the objects in it. Readers pin a segment while they
+ * read it, so it is only closed once the last of them is done.
+ */
+typedef struct DiskSegment
+{
+    int id;
+    int fd;
+    off_t size;
+    int ref_cnt;                    /* The segment list holds one */
+    struct DiskSegment *newer;
+} DiskSegment;
+
+
+/* Where the latest copy of a uri is on disk */
+typedef struct DiskEntry
+{
+    char *uri;
+    unsigned long hash;
+    DiskSegment *segment;
+    off_t offset;                   /* Of the object in the segment */
+    unsigned int head_len;
+    unsigned int obj_size;
+    unsigned long checksum;
+    size_t chunked_size;
+    size_t plain_size;
+    size_t gzip_size;
+    time_t fresh_until;
+    long lifetime;
+    long stale_window;
+    struct DiskEntry *next;         /* Next entry in the same bucket */
+} DiskEntry;
+
+
+/* An evicted object on its way to the writer, pinned */
+typedef struct DiskJob
+{
+    CacheEntry *entry;
+    struct DiskJob *next;
+} DiskJob;
+
+
+typedef struct
+{
+    unsigned long objects;
+    unsigned long bytes;            /* Of all segments, live or not */
+    int segments;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long writes;
+    unsigned long dropped;          /* Evictions not written, queue full */
+} DiskStats;
+
+
+void InitDiskCache(char *dir);
+void SpillToDisk(CacheEntry *entry);
+int ReadDiskCache(CacheEntry *fill);
+int GetDiskStats(DiskStats *stats);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,315 @@
+/*
+ * dns.c - Cache of name lookups, resolved by a small pool of threads.
+ *     A repeat origin connects without a resolver round trip, lookups of
+ *     the same host:port in flight are shared, and a slow lookup holds a
+ *     resolver thread rather than the worker or event loop that needs it.
+ */
+#include "dns.h"
+#include "hash.h"
+
+
+static DnsEntry *Lookup(char *host, char *port, DnsCallback done, void *arg,
+                        DnsAddrs **addrs);
+static void *Resolver(void *vargp);
+static DnsBucket *BucketOf(char *host, char *port);
+static DnsAddrs *PinAddrs(DnsAddrs *addrs);
+static void QueueJob(DnsEntry *entry);
+static int CanDrop(DnsEntry *entry);
+static void DropLeastRecent(DnsBucket *bucket);
+static void FreeEntry(DnsEntry *entry);
+
+
+static DnsBucket buckets[DNS_BUCKETS];
+
+/* Entries waiting for a resolver */
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static DnsEntry *jobs_head, *jobs_tail;
+
+
+void InitResolver()
+{
+    pthread_t tid;
+
+    for (int i = 0; i < DNS_BUCKETS; i++)
+    {
+        pthread_mutex_init(&buckets[i].mutex, NULL);
+        pthread_cond_init(&buckets[i].done, NULL);
+        buckets[i].entries = NULL;
+        buckets[i].count = 0;
+    }
+    for (int i = 0; i < NRESOLVERS; i++)
+        Pthread_create(&tid, NULL, Resolver, NULL);
+}
+
+
+/*
+ * ResolveHost - Return the addresses of host:port pinned, from the cache
+ *     or once a resolver looked them up, or NULL if the lookup failed or
+ *     took longer than DNS_WAIT_TIMEOUT. Release them with ReleaseAddrs.
+ *     Only blocks when the cache has no addresses for host:port at all.
+ */
+DnsAddrs *ResolveHost(char *host, char *port)
+{
+    DnsBucket *bucket = BucketOf(host, port);
+    DnsAddrs *addrs;
+    struct timespec deadline;
+
+    DnsEntry *entry = Lookup(host, port, NULL, NULL, &addrs);
+    if (entry == NULL)
+        return addrs;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DNS_WAIT_TIMEOUT;
+
+    pthread_mutex_lock(&bucket->mutex);
+    while (entry->state == DNS_PENDING)
+    {
+        if (pthread_cond_timedwait(&bucket->done, &bucket->mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    addrs = entry->state == DNS_DONE ? PinAddrs(entry->addrs) : NULL;
+    entry->sleepers--;
+    pthread_mutex_unlock(&bucket->mutex);
+    return addrs;
+}
+
+
+/*
+ * ResolveHostAsync - Set *addrs to the cached addresses of host:port,
+ *     pinned or NULL for a failed lookup, and return 1. If they still
+ *     have to be looked up, return 0 instead and call done with them
+ *     from a resolver thread later.
+ */
+int ResolveHostAsync(char *host, char *port, DnsCallback done, void *arg,
+                     DnsAddrs **addrs)
+{
+    return Lookup(host, port, done, arg, addrs) == NULL;
+}
+
+
+void ReleaseAddrs(DnsAddrs *addrs)
+{
+    if (addrs != NULL && __atomic_sub_fetch(&addrs->ref_cnt, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        freeaddrinfo(addrs->list);
+        Free(addrs);
+    }
+}
+
+
+/*
+ * Lookup - Find host:port in the cache. Sets *addrs and returns NULL if
+ *     its lookup is fresh, or if it found addresses that have expired,
+ *     then starting a lookup in the background to refresh them unless
+ *     one runs already. Otherwise leaves done to be called, if given,
+ *     starts a lookup unless one is pending, and returns the entry. A
+ *     caller that gave no done must wait for the entry in ResolveHost.
+ *     Failed lookups past their time are dropped on the way, and the
+ *     least recently used entry once the bucket holds too many.
+ */
+static DnsEntry *Lookup(char *host, char *port, DnsCallback done, void *arg,
+                        DnsAddrs **addrs)
+{
+    DnsBucket *bucket = BucketOf(host, port);
+    DnsEntry *entry, **prev;
+    time_t now = time(NULL);
+    int start = 0;
+
+    pthread_mutex_lock(&bucket->mutex);
+    for (prev = &bucket->entries; (entry = *prev) != NULL; )
+    {
+        if (!strcmp(entry->host, host) && !strcmp(entry->port, port))
+            break;
+        if (entry->addrs == NULL && now >= entry->expires && CanDrop(entry))
+        {
+            *prev = entry->next;
+            bucket->count--;
+            FreeEntry(entry);
+            continue;
+        }
+        prev = &entry->next;
+    }
+    if (entry != NULL)
+    {
+        *prev = entry->next;
+        entry->next = bucket->entries;
+        bucket->entries = entry;
+    }
+    else
+    {
+        entry = Calloc(1, sizeof(DnsEntry));
+        entry->host = Malloc(strlen(host) + 1);
+        strcpy(entry->host, host);
+        entry->port = Malloc(strlen(port) + 1);
+        strcpy(entry->port, port);
+        entry->next = bucket->entries;
+        bucket->entries = entry;
+        if (++bucket->count > DNS_BUCKET_ENTRIES)
+            DropLeastRecent(bucket);
+        start = 1;
+    }
+
+    if (entry->state == DNS_DONE && (now < entry->expires || entry->addrs != NULL))
+    {
+        start = now >= entry->expires && !entry->refreshing;
+        entry->refreshing |= start;
+        *addrs = PinAddrs(entry->addrs);
+        pthread_mutex_unlock(&bucket->mutex);
+        if (start)
+            QueueJob(entry);
+        return NULL;
+    }
+    if (entry->state == DNS_DONE)
+        start = 1;
+
+    if (done != NULL)
+    {
+        DnsWaiter *waiter = Malloc(sizeof(DnsWaiter));
+        waiter->done = done;
+        waiter->arg = arg;
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+    }
+    else
+    {
+        entry->sleepers++;
+    }
+    entry->state = DNS_PENDING;
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (start)
+        QueueJob(entry);
+    return entry;
+}
+
+
+/* QueueJob - Hand entry to the resolvers */
+static void QueueJob(DnsEntry *entry)
+{
+    pthread_mutex_lock(&jobs_mutex);
+    entry->next_job = NULL;
+    if (jobs_tail != NULL)
+        jobs_tail->next_job = entry;
+    else
+        jobs_head = entry;
+    jobs_tail = entry;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+
+/*
+ * Resolver - Look up the queued entries one at a time. Waiters blocked
+ *     in ResolveHost are woken, and the callbacks left are called once
+ *     the bucket is unlocked.
+ */
+static void *Resolver(void *vargp)
+{
+    struct addrinfo hints, *list;
+
+    Pthread_detach(pthread_self());
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+
+    while (1)
+    {
+        pthread_mutex_lock(&jobs_mutex);
+        while (jobs_head == NULL)
+            pthread_cond_wait(&jobs_cond, &jobs_mutex);
+        DnsEntry *entry = jobs_head;
+        if ((jobs_head = entry->next_job) == NULL)
+            jobs_tail = NULL;
+        pthread_mutex_unlock(&jobs_mutex);
+
+        DnsAddrs *addrs = NULL;
+        if (getaddrinfo(entry->host, entry->port, &hints, &list) == 0)
+        {
+            addrs = Malloc(sizeof(DnsAddrs));
+            addrs->list = list;
+            addrs->ref_cnt = 1;
+        }
+
+        DnsBucket *bucket = BucketOf(entry->host, entry->port);
+        pthread_mutex_lock(&bucket->mutex);
+        ReleaseAddrs(entry->addrs);
+        entry->addrs = addrs;
+        entry->state = DNS_DONE;
+        entry->refreshing = 0;
+        entry->expires = time(NULL) + (addrs ? DNS_TTL : DNS_NEGATIVE_TTL);
+        DnsWaiter *waiters = entry->waiters;
+        entry->waiters = NULL;
+        for (DnsWaiter *w = waiters; w; w = w->next)
+            PinAddrs(addrs);
+        pthread_cond_broadcast(&bucket->done);
+        pthread_mutex_unlock(&bucket->mutex);
+
+        while (waiters != NULL)
+        {
+            DnsWaiter *w = waiters;
+            waiters = w->next;
+            w->done(w->arg, addrs);
+            Free(w);
+        }
+    }
+    return NULL;
+}
+
+
+/* BucketOf - The bucket of host and port, hashed as one string */
+static DnsBucket *BucketOf(char *host, char *port)
+{
+    unsigned long hash = HashBytes(HashString(host), port, strlen(port));
+
+    return &buckets[hash & (DNS_BUCKETS - 1)];
+}
+
+
+static DnsAddrs *PinAddrs(DnsAddrs *addrs)
+{
+    if (addrs != NULL)
+        __atomic_add_fetch(&addrs->ref_cnt, 1, __ATOMIC_RELAXED);
+    return addrs;
+}
+
+
+/* CanDrop - Whether no lookup, waiter or sleeper still needs entry */
+static int CanDrop(DnsEntry *entry)
+{
+    return entry->state == DNS_DONE && !entry->refreshing && entry->waiters == NULL
+        && entry->sleepers == 0;
+}
+
+
+/*
+ * DropLeastRecent - Drop the least recently used entry of bucket that
+ *     can be, if any. Caller holds the mutex of bucket.
+ */
+static void DropLeastRecent(DnsBucket *bucket)
+{
+    DnsEntry **victim = NULL;
+
+    for (DnsEntry **prev = &bucket->entries; *prev; prev = &(*prev)->next)
+    {
+        if (CanDrop(*prev))
+            victim = prev;
+    }
+    if (victim != NULL)
+    {
+        DnsEntry *entry = *victim;
+        *victim = entry->next;
+        bucket->count--;
+        FreeEntry(entry);
+    }
+}
+
+
+/* FreeEntry - Free entry, unlinked, and unpin its addresses */
+static void FreeEntry(DnsEntry *entry)
+{
+    ReleaseAddrs(entry->addrs);
+    Free(entry->host);
+    Free(entry->port);
+    Free(entry);
+}
@@ -0,0 +1,82 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+/* Seconds a lookup is cached for, and a failed one */
+#define DNS_TTL 60
+#define DNS_NEGATIVE_TTL 5
+
+/* Seconds ResolveHost waits for a lookup in progress */
+#define DNS_WAIT_TIMEOUT 5
+
+#define NRESOLVERS 2
+
+/* Hash buckets of the cache, a power of 2 */
+#define DNS_BUCKETS 64
+
+/* Entries kept per bucket, the least recently used dropped first */
+#define DNS_BUCKET_ENTRIES 32
+
+/* States of a cache entry */
+#define DNS_PENDING 0
+#define DNS_DONE 1
+
+
+/* The addresses of a lookup, shared by the cache and its callers */
+typedef struct
+{
+    struct addrinfo *list;
+    int ref_cnt;
+} DnsAddrs;
+
+
+/* Called from a resolver thread once a lookup ends, addrs NULL on failure */
+typedef void (*DnsCallback)(void *arg, DnsAddrs *addrs);
+
+typedef struct DnsWaiter
+{
+    DnsCallback done;
+    void *arg;
+    struct DnsWaiter *next;
+} DnsWaiter;
+
+
+/*
+ * A host:port and its last lookup. While a lookup is pending, callers
+ * waiting for it block on the bucket's cond, or leave a callback, and
+ * the entry is not dropped while either of them may still look at it.
+ * Addresses past DNS_TTL are still handed out while refreshing is set,
+ * the lookup that replaces them running in the background.
+ */
+typedef struct DnsEntry
+{
+    char *host;
+    char *port;
+    int state;
+    DnsAddrs *addrs;                /* NULL if the last lookup failed */
+    time_t expires;
+    int refreshing;
+    DnsWaiter *waiters;
+    int sleepers;                   /* Callers blocked in ResolveHost */
+    struct DnsEntry *next;          /* Next entry in the same bucket */
+    struct DnsEntry *next_job;      /* Next entry to resolve */
+} DnsEntry;
+
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t done;            /* Broadcast when a lookup ends */
+    DnsEntry *entries;              /* Most recently used first */
+    int count;
+} DnsBucket;
+
+
+void InitResolver();
+DnsAddrs *ResolveHost(char *host, char *port);
+int ResolveHostAsync(char *host, char *port, DnsCallback done, void *arg,
+                     DnsAddrs **addrs);
+void ReleaseAddrs(DnsAddrs *addrs);
+
+#endif /* __DNS_H__ */
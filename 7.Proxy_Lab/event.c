@@ -0,0 +1,943 @@
+/*
+ * event.c - Event driven proxy core, chosen with -E. Each of NTHREADS
+ *     threads runs its own epoll loop over non-blocking sockets and moves
+ *     every connection it accepts through a small state machine, so a
+ *     thread only works on connections that are ready, and a slow client
+ *     costs a few buffers instead of a whole worker. Origins are held to
+ *     the connect and read deadlines, and the per-origin slots, of the
+ *     threaded mode.
+ */
+#define _GNU_SOURCE             /* accept4(), memmem() */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+
+#include "csapp.h"
+#include "cache.h"
+#include "disk.h"
+#include "dns.h"
+#include "fresh.h"
+#include "gzip.h"
+#include "http.h"
+#include "log.h"
+#include "origin.h"
+#include "proxy.h"
+#include "stats.h"
+
+#define MAX_EVENTS 64
+
+/* ms between checks of the deadlines of conns waiting on an origin */
+#define DEADLINE_TICK 250
+
+/* Connection states */
+#define CONN_READ_REQUEST 0     /* Reading the client's request head */
+#define CONN_RESOLVE 1          /* Waiting for a resolver */
+#define CONN_CONNECT 2          /* Waiting for the origin to accept */
+#define CONN_SEND_REQUEST 3     /* Writing the request to the origin */
+#define CONN_RELAY 4            /* Relaying the response to the client */
+#define CONN_SEND_CACHED 5      /* Writing a cached object to the client */
+#define CONN_CLOSED 6           /* Freed once the current batch is done */
+#define CONN_WAIT_SLOT 7        /* Waiting for a free slot on the origin */
+
+
+typedef struct Conn Conn;
+
+
+/*
+ * An event loop. Resolvers hand back the connections whose lookup ended
+ * on its resolved list, and wake it through resolved_fd, an eventfd.
+ * The connections waiting on an origin with a deadline are on timed.
+ */
+typedef struct
+{
+    int epfd;
+    int resolved_fd;
+    pthread_mutex_t mutex;
+    Conn *resolved;
+    Conn *timed;
+} Loop;
+
+/* One socket of a connection, what epoll hands back for it */
+typedef struct
+{
+    int fd;
+    uint32_t events;            /* Events it is registered for, 0 if none */
+    Conn *conn;
+} Endpoint;
+
+
+struct Conn
+{
+    int state;
+    int epfd;
+    Loop *loop;
+    Endpoint client;
+    Endpoint server;
+
+    char req[MAXBUF];           /* Request from the client, then the head of
+                                   the response, or the framing of a
+                                   cached one */
+    size_t req_len;
+    HttpRequest http;           /* The client's request, parsed in req */
+
+    URI origin;
+    HttpBuilder out;            /* Request to the origin, mostly slices of req */
+    size_t req_sent;
+    int has_slot;               /* Holds one of the origin's slots */
+    long deadline;              /* ms the origin must connect or send by,
+                                   0 while not waited on */
+
+    DnsAddrs *addrs;            /* Origin addresses */
+    struct addrinfo *next_addr; /* Next one to try */
+
+    CacheEntry *entry;          /* Cached object being sent */
+    CacheEntry *fill;           /* Pending entry the response goes into */
+    size_t sent;
+
+    char *buf;                  /* Response bytes read but not yet sent */
+    size_t buf_start;
+    size_t buf_end;
+
+    int head_done;
+    long content_length;
+    long body_len;
+
+    /* For the access log, once the request is started */
+    char uri[MAXLINE];
+    char *cache_result;         /* "hit" or "miss", NULL before */
+    int answered;               /* The whole response was sent */
+    struct timespec start;
+
+    Conn *next_closed;
+    Conn *next_resolved;
+    Conn *prev_timed;
+    Conn *next_timed;
+};
+
+
+static void *EventLoop(void *vargp);
+static void AcceptConns(Loop *loop, int listenfd);
+static void StartFetch(Conn *conn);
+static void ResolveDone(void *arg, DnsAddrs *addrs);
+static void ConnectResolved(Loop *loop);
+static void HandleEvent(Endpoint *ep, uint32_t events);
+static void ReadRequest(Conn *conn);
+static void StartRequest(Conn *conn);
+static void ConnectNext(Conn *conn);
+static void SendRequest(Conn *conn);
+static void RelayFromServer(Conn *conn);
+static void FlushToClient(Conn *conn);
+static void SendCached(Conn *conn);
+static void FinishRelay(Conn *conn);
+static void ScanHead(Conn *conn, char *data, size_t n);
+static void CacheHead(Conn *conn);
+static void Watch(Conn *conn, Endpoint *ep, uint32_t events);
+static void SendError(Conn *conn, char *msg);
+static void SendStats(Conn *conn, int json);
+static void CloseConn(Conn *conn);
+static void SetDeadline(Conn *conn, long ms);
+static void ClearDeadline(Conn *conn);
+static void ExpireConns(Loop *loop);
+static long NowMs(void);
+
+
+/* Connections closed in the batch of events being handled */
+static __thread Conn *closed_conns;
+
+
+/*
+ * ServeEvents - Serve listenfd from NTHREADS event loops, the calling
+ *     thread running one of them. Never returns.
+ */
+void ServeEvents(int listenfd)
+{
+    pthread_t tid;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    for (int i = 1; i < NTHREADS; i++)
+        Pthread_create(&tid, NULL, EventLoop, (void *) (long) listenfd);
+    EventLoop((void *) (long) listenfd);
+}
+
+
+/*
+ * EventLoop - Wait for ready sockets and handle them. Every loop watches
+ *     listenfd with EPOLLEXCLUSIVE, so a new connection wakes one loop,
+ *     which then owns it until it is closed. While any conn waits on an
+ *     origin, the deadlines are checked every DEADLINE_TICK.
+ */
+static void *EventLoop(void *vargp)
+{
+    int listenfd = (long) vargp;
+    Loop loop;
+    struct epoll_event ev, events[MAX_EVENTS];
+    long checked = 0;
+
+    if ((loop.epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    if ((loop.resolved_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+        unix_error("eventfd error");
+    pthread_mutex_init(&loop.mutex, NULL);
+    loop.resolved = NULL;
+    loop.timed = NULL;
+
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.resolved_fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    while (1)
+    {
+        int n = epoll_wait(loop.epfd, events, MAX_EVENTS, loop.timed ? DEADLINE_TICK : -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            unix_error("epoll_wait error");
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+                AcceptConns(&loop, listenfd);
+            else if (events[i].data.ptr == &loop)
+                ConnectResolved(&loop);
+            else
+                HandleEvent(events[i].data.ptr, events[i].events);
+        }
+        if (loop.timed != NULL && NowMs() - checked >= DEADLINE_TICK)
+        {
+            ExpireConns(&loop);
+            checked = NowMs();
+        }
+
+        /* Later events of the batch may still have pointed at these */
+        while (closed_conns != NULL)
+        {
+            Conn *conn = closed_conns;
+            closed_conns = conn->next_closed;
+            Free(conn);
+        }
+    }
+    return NULL;
+}
+
+
+static void AcceptConns(Loop *loop, int listenfd)
+{
+    int connfd;
+    int one = 1;               /* TCP_NODELAY, as in Acceptor */
+
+    for (int i = 0; i < MAX_EVENTS; i++)
+    {
+        if ((connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOG(LOG_ERROR, "accept error: %s", strerror(errno));
+            return;
+        }
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Conn *conn = Calloc(1, sizeof(Conn));
+        conn->state = CONN_READ_REQUEST;
+        conn->epfd = loop->epfd;
+        conn->loop = loop;
+        conn->client.fd = connfd;
+        conn->client.conn = conn;
+        conn->server.fd = -1;
+        conn->server.conn = conn;
+        conn->content_length = -1;
+        HttpInitRequest(&conn->http);
+        Watch(conn, &conn->client, EPOLLIN);
+    }
+}
+
+
+static void HandleEvent(Endpoint *ep, uint32_t events)
+{
+    Conn *conn = ep->conn;
+
+    if (conn->state == CONN_CLOSED)
+        return;
+
+    /* The client going away ends the connection, whatever it was doing */
+    if (ep == &conn->client && (events & (EPOLLHUP | EPOLLERR))
+        && conn->state != CONN_READ_REQUEST)
+    {
+        CloseConn(conn);
+        return;
+    }
+
+    switch (conn->state)
+    {
+    case CONN_READ_REQUEST:
+        ReadRequest(conn);
+        break;
+    case CONN_CONNECT:
+    case CONN_SEND_REQUEST:
+        SendRequest(conn);
+        break;
+    case CONN_RELAY:
+        if (ep == &conn->server)
+            RelayFromServer(conn);
+        else
+            FlushToClient(conn);
+        break;
+    case CONN_SEND_CACHED:
+        SendCached(conn);
+        break;
+    }
+}
+
+
+/* ReadRequest - Read the request head, then start on it once complete */
+static void ReadRequest(Conn *conn)
+{
+    ssize_t n = read(conn->client.fd, conn->req + conn->req_len,
+                     MAXBUF - conn->req_len);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        CloseConn(conn);
+        return;
+    }
+
+    conn->req_len += n;
+    ssize_t rc = HttpParseRequest(&conn->http, conn->req, conn->req_len);
+    if (rc > 0)
+        StartRequest(conn);
+    else if (rc < 0)
+        SendError(conn, "Malformed request\n");
+    else if (conn->req_len == MAXBUF)
+        SendError(conn, "Request header too large\n");
+}
+
+
+/*
+ * StartRequest - Answer the request from the cache, or look up the origin
+ *     and start connecting to it. A miss on a uri another connection is
+ *     fetching is fetched uncached, as an event loop must not wait.
+ */
+static void StartRequest(Conn *conn)
+{
+    char *method = conn->http.method.p, *uri = conn->http.target.p;
+
+    LOG(LOG_DEBUG, "%s %s HTTP/1.%d", method, uri, conn->http.minor);
+
+    /* Only GET is implemented for now */
+    if (strcasecmp(method, "GET"))
+    {
+        SendError(conn, "Proxy does not implement the method\n");
+        return;
+    }
+
+    int json;
+    if (IsStatsRequest(uri, &json))
+    {
+        SendStats(conn, json);
+        return;
+    }
+
+    Watch(conn, &conn->client, 0);
+    strcpy(conn->uri, uri);
+    clock_gettime(CLOCK_MONOTONIC, &conn->start);
+    conn->cache_result = "hit";
+    if ((conn->entry = PollCacheOrFill(uri, &conn->fill)) == NULL
+        && conn->fill != NULL && ReadDiskCache(conn->fill) == 0)
+    {
+        /* Objects fit in MAX_OBJECT_SIZE, a pread mostly hits the page cache */
+        conn->entry = PinCacheEntry(conn->fill);
+        PublishCacheFill(conn->fill);
+        conn->fill = NULL;
+        conn->cache_result = "disk";
+    }
+
+    /*
+     * A stale entry is fetched again in full, into a fill replacing it.
+     * Revalidating it would need the 304 held back from the client, and
+     * the response is relayed as it arrives.
+     */
+    if (conn->entry != NULL && !IsFresh(conn->entry))
+    {
+        conn->fill = BeginCacheRefresh(conn->entry);
+        ReleaseCacheEntry(conn->entry);
+        conn->entry = NULL;
+    }
+
+    /* Chunks of a large object may have to be waited for, or fetched */
+    if (conn->entry != NULL && conn->entry->chunked_size > 0)
+    {
+        ReleaseCacheEntry(conn->entry);
+        conn->entry = NULL;
+    }
+    if (conn->entry != NULL)
+    {
+        LOG(LOG_DEBUG, "Found in cache, size: %lu", conn->entry->obj_size);
+        conn->state = CONN_SEND_CACHED;
+        conn->sent = 0;
+
+        /*
+         * req holds the framing headers written between head and body. A
+         * client taking gzip is sent the gzip variant, if there is one.
+         */
+        CacheEntry *variant;
+        conn->req_len = 0;
+        if (AcceptsGzip(HttpFindHeader(&conn->http, "Accept-Encoding"))
+            && (variant = ReadGzipVariant(conn->entry)) != NULL)
+        {
+            ReleaseCacheEntry(conn->entry);
+            conn->entry = variant;
+            conn->req_len = sprintf(conn->req, "%s", GZIP_ENCODING_HEADER);
+        }
+        CacheEntry *entry = conn->entry;
+        conn->req_len += FormatFraming(conn->req + conn->req_len,
+                                       entry->obj_size - entry->head_len, 0);
+        SendCached(conn);
+        return;
+    }
+    conn->cache_result = "miss";
+
+    if (ParseUri(conn->http.target, &conn->origin) < 0)
+    {
+        SendError(conn, "Malformed request\n");
+        return;
+    }
+
+    /*
+     * As in AcquireOrigin, an origin with every slot taken is given until
+     * ORIGIN_CONNECT_TIMEOUT to free one, see ExpireConns.
+     */
+    if (!TakeOriginSlot(conn->origin.host, conn->origin.port))
+    {
+        conn->state = CONN_WAIT_SLOT;
+        SetDeadline(conn, ORIGIN_CONNECT_TIMEOUT);
+        return;
+    }
+    conn->has_slot = 1;
+    StartFetch(conn);
+}
+
+
+/* StartFetch - Look up the origin of conn, which holds a slot on it */
+static void StartFetch(Conn *conn)
+{
+    BuildServerRequest(&conn->out, &conn->origin, HttpFindHeader(&conn->http, "Host"), 0, NULL);
+    conn->req_sent = 0;
+
+    /* A lookup not cached yet goes on without us, see ConnectResolved */
+    conn->state = CONN_RESOLVE;
+    if (!ResolveHostAsync(conn->origin.host, conn->origin.port, ResolveDone, conn,
+                          &conn->addrs))
+        return;
+    if (conn->addrs == NULL)
+    {
+        SendError(conn, "Fail to connect\n");
+        return;
+    }
+    conn->next_addr = conn->addrs->list;
+    SetDeadline(conn, ORIGIN_CONNECT_TIMEOUT);
+    ConnectNext(conn);
+}
+
+
+/*
+ * ResolveDone - Called by a resolver once the lookup for conn ends. No
+ *     socket of conn is watched meanwhile, so it cannot have been closed.
+ */
+static void ResolveDone(void *arg, DnsAddrs *addrs)
+{
+    Conn *conn = arg;
+    Loop *loop = conn->loop;
+    uint64_t one = 1;
+
+    conn->addrs = addrs;
+    pthread_mutex_lock(&loop->mutex);
+    conn->next_resolved = loop->resolved;
+    loop->resolved = conn;
+    pthread_mutex_unlock(&loop->mutex);
+    write(loop->resolved_fd, &one, sizeof(one));
+}
+
+
+/* ConnectResolved - Start connecting the conns whose lookup ended */
+static void ConnectResolved(Loop *loop)
+{
+    uint64_t cnt;
+
+    read(loop->resolved_fd, &cnt, sizeof(cnt));
+    pthread_mutex_lock(&loop->mutex);
+    Conn *conn = loop->resolved;
+    loop->resolved = NULL;
+    pthread_mutex_unlock(&loop->mutex);
+
+    while (conn != NULL)
+    {
+        Conn *next = conn->next_resolved;
+        if (conn->addrs == NULL)
+        {
+            SendError(conn, "Fail to connect\n");
+        }
+        else
+        {
+            conn->next_addr = conn->addrs->list;
+            SetDeadline(conn, ORIGIN_CONNECT_TIMEOUT);
+            ConnectNext(conn);
+        }
+        conn = next;
+    }
+}
+
+
+/*
+ * ConnectNext - Start a non-blocking connect to the next origin address.
+ *     All of them share the one ORIGIN_CONNECT_TIMEOUT deadline.
+ */
+static void ConnectNext(Conn *conn)
+{
+    if (conn->server.fd >= 0)
+    {
+        Watch(conn, &conn->server, 0);
+        close(conn->server.fd);
+        conn->server.fd = -1;
+    }
+
+    for (; conn->next_addr != NULL; conn->next_addr = conn->next_addr->ai_next)
+    {
+        struct addrinfo *p = conn->next_addr;
+        int fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+
+        if (fd < 0)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0 || errno == EINPROGRESS)
+        {
+            conn->next_addr = p->ai_next;
+            conn->server.fd = fd;
+            conn->state = CONN_CONNECT;
+            Watch(conn, &conn->server, EPOLLOUT);
+            return;
+        }
+        close(fd);
+    }
+    SendError(conn, "Fail to connect\n");
+}
+
+
+/* SendRequest - Once connected, write the request to the origin */
+static void SendRequest(Conn *conn)
+{
+    if (conn->state == CONN_CONNECT)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(conn->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+        {
+            ConnectNext(conn);
+            return;
+        }
+        conn->state = CONN_SEND_REQUEST;
+        SetDeadline(conn, ORIGIN_READ_TIMEOUT * 1000);
+    }
+
+    while (conn->req_sent < conn->out.len)
+    {
+        ssize_t n = WritevFrom(conn->server.fd, conn->out.iov, conn->out.cnt,
+                               conn->req_sent);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            CloseConn(conn);
+            return;
+        }
+        conn->req_sent += n;
+    }
+
+    /* req now collects the head of the response */
+    conn->req_len = 0;
+    conn->buf = Malloc(RELAY_BUFSIZE);
+    conn->buf_start = conn->buf_end = 0;
+    conn->state = CONN_RELAY;
+    SetDeadline(conn, ORIGIN_READ_TIMEOUT * 1000);
+    Watch(conn, &conn->server, EPOLLIN);
+}
+
+
+/*
+ * RelayFromServer - Read the next block of the response, add it to the
+ *     fill and pass it on. Only called with nothing left to send, so
+ *     the origin is read no faster than the client takes the response.
+ */
+static void RelayFromServer(Conn *conn)
+{
+    ssize_t n = read(conn->server.fd, conn->buf, RELAY_BUFSIZE);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n < 0)
+    {
+        CloseConn(conn);
+        return;
+    }
+    if (n == 0)
+    {
+        FinishRelay(conn);
+        return;
+    }
+    LOG(LOG_DEBUG, "proxy received %d bytes...", (int) n);
+
+    ScanHead(conn, conn->buf, n);
+    conn->buf_start = 0;
+    conn->buf_end = n;
+    FlushToClient(conn);
+}
+
+
+/*
+ * FlushToClient - Send what is buffered. Watch the client while it cannot
+ *     take more, and the origin again once the buffer is empty, giving it
+ *     ORIGIN_READ_TIMEOUT to send more. A slow client is no fault of the
+ *     origin's, so there is no deadline meanwhile.
+ */
+static void FlushToClient(Conn *conn)
+{
+    while (conn->buf_start < conn->buf_end)
+    {
+        ssize_t n = write(conn->client.fd, conn->buf + conn->buf_start,
+                          conn->buf_end - conn->buf_start);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            ClearDeadline(conn);
+            Watch(conn, &conn->server, 0);
+            Watch(conn, &conn->client, EPOLLOUT);
+            return;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            CloseConn(conn);
+            return;
+        }
+        conn->buf_start += n;
+    }
+
+    SetDeadline(conn, ORIGIN_READ_TIMEOUT * 1000);
+    Watch(conn, &conn->client, 0);
+    Watch(conn, &conn->server, EPOLLIN);
+}
+
+
+static void SendCached(Conn *conn)
+{
+    CacheEntry *entry = conn->entry;
+    struct iovec iov[3] = {
+        { entry->obj, entry->head_len },
+        { conn->req, conn->req_len },
+        { entry->obj + entry->head_len, entry->obj_size - entry->head_len },
+    };
+
+    while (conn->sent < entry->obj_size + conn->req_len)
+    {
+        ssize_t n = WritevFrom(conn->client.fd, iov, 3, conn->sent);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            Watch(conn, &conn->client, EPOLLOUT);
+            return;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        conn->sent += n;
+    }
+    conn->answered = conn->sent == entry->obj_size + conn->req_len;
+    CloseConn(conn);
+}
+
+
+/*
+ * FinishRelay - The origin closed, so the response is complete. Publish
+ *     the fill unless the body fell short of its Content-Length.
+ */
+static void FinishRelay(Conn *conn)
+{
+    CacheEntry *fill = conn->fill;
+
+    conn->answered = conn->head_done
+        && (conn->content_length < 0 || conn->body_len >= conn->content_length);
+    conn->fill = NULL;
+    if (fill != NULL)
+    {
+        if (!conn->answered)
+        {
+            AbortCacheFill(fill);
+        }
+        else
+        {
+            CompressCacheFill(fill);
+            LOG(LOG_DEBUG, "Write to cache, size: %lu", fill->obj_size);
+            PublishCacheFill(fill);
+        }
+    }
+    CloseConn(conn);
+}
+
+
+/*
+ * ScanHead - Collect the response head in req, then add the response to
+ *     the fill in the form the cache keeps it: the head less its framing
+ *     headers, then the body. A fill known to be too large is dropped
+ *     before any of it is buffered, and one that fits is sized once.
+ */
+static void ScanHead(Conn *conn, char *data, size_t n)
+{
+    if (!conn->head_done)
+    {
+        size_t old_len = conn->req_len;
+        size_t copy = n < MAXBUF - 1 - old_len ? n : MAXBUF - 1 - old_len;
+
+        memcpy(conn->req + old_len, data, copy);
+        conn->req_len += copy;
+        conn->req[conn->req_len] = '\0';
+
+        char *end = memmem(conn->req, conn->req_len, "\r\n\r\n", 4);
+        if (end == NULL)
+        {
+            /* A head this long is relayed, but not cached */
+            if (conn->req_len == MAXBUF - 1)
+            {
+                conn->head_done = 1;
+                if (conn->fill != NULL)
+                    AbortCacheFill(conn->fill);
+                conn->fill = NULL;
+            }
+            return;
+        }
+
+        size_t head_size = end + 4 - conn->req;
+        conn->head_done = 1;
+        end[2] = '\0';
+        CacheHead(conn);
+
+        data += head_size - old_len;
+        n -= head_size - old_len;
+    }
+
+    conn->body_len += n;
+    if (conn->fill != NULL && !AppendCacheFill(conn->fill, data, n))
+        conn->fill = NULL;
+}
+
+
+/*
+ * CacheHead - Learn Content-Length and the freshness from the response
+ *     head in req, and add the head to the fill without its framing
+ *     headers, unless the response must not be cached.
+ */
+static void CacheHead(Conn *conn)
+{
+    char *line = conn->req, *next;
+    int status = 0;
+    Freshness fresh;
+
+    sscanf(line, "HTTP/1.%*d %d", &status);
+    InitFreshness(&fresh);
+    for (; (next = strstr(line, "\r\n")) != NULL; line = next + 2)
+    {
+        if (!strncasecmp(line, "Content-Length:", 15))
+            conn->content_length = strtol(line + 15, NULL, 10);
+        ScanFreshness(&fresh, line);
+        if (conn->fill != NULL && !IsFramingHeader(line)
+            && !AppendCacheFill(conn->fill, line, next + 2 - line))
+            conn->fill = NULL;
+    }
+
+    if (conn->fill == NULL)
+        return;
+    long lifetime = ResponseLifetime(&fresh, status);
+    if (lifetime < 0)
+    {
+        AbortCacheFill(conn->fill);
+        conn->fill = NULL;
+        return;
+    }
+    conn->fill->lifetime = lifetime;
+    conn->fill->stale_window = StaleWindow(&fresh);
+    RenewFreshness(conn->fill, lifetime);
+    conn->fill->head_len = conn->fill->obj_size;
+    if (conn->content_length >= 0
+        && !ReserveCacheFill(conn->fill, conn->fill->head_len + conn->content_length))
+        conn->fill = NULL;
+}
+
+
+/* Watch - Register ep for events only, removing it for none */
+static void Watch(Conn *conn, Endpoint *ep, uint32_t events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (ep->events == events)
+        return;
+
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else if (ep->events == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+
+    if (epoll_ctl(conn->epfd, op, ep->fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ep->events = events;
+}
+
+
+/* SendError - Tell the client what went wrong, best effort, and close */
+static void SendError(Conn *conn, char *msg)
+{
+    LOG(LOG_WARN, "%s", msg);
+    write(conn->client.fd, msg, strlen(msg));
+    CloseConn(conn);
+}
+
+
+/*
+ * SendStats - Answer a request for STATS_PATH and close. Best effort like
+ *     SendError, the report fits the send buffer of a new connection.
+ */
+static void SendStats(Conn *conn, int json)
+{
+    char *buf = Malloc(STATS_BUFSIZE);
+
+    size_t n = FormatStatsResponse(buf, json, NULL, 0);
+    write(conn->client.fd, buf, n);
+    Free(buf);
+    CloseConn(conn);
+}
+
+
+/*
+ * CloseConn - Close both sockets and let go of the cache. The Conn itself
+ *     is freed by the event loop after the batch it was closed in. The
+ *     origin slot goes back first, before the client, seeing its socket
+ *     closed, can send the next request for one.
+ */
+static void CloseConn(Conn *conn)
+{
+    if (conn->server.fd >= 0)
+    {
+        Watch(conn, &conn->server, 0);
+        close(conn->server.fd);
+    }
+    if (conn->has_slot)
+        FreeOriginSlot(conn->origin.host, conn->origin.port);
+    ClearDeadline(conn);
+    Watch(conn, &conn->client, 0);
+    close(conn->client.fd);
+
+    if (conn->cache_result != NULL)
+    {
+        int hit = conn->entry != NULL;
+        long us = CountRequest(hit, conn->answered,
+                               hit && conn->answered ? conn->entry->obj_size : 0, &conn->start);
+        LogAccess("GET", conn->uri, conn->cache_result, conn->answered, us);
+    }
+    if (conn->entry != NULL)
+        ReleaseCacheEntry(conn->entry);
+    if (conn->fill != NULL)
+        AbortCacheFill(conn->fill);
+    if (conn->addrs != NULL)
+        ReleaseAddrs(conn->addrs);
+    if (conn->buf != NULL)
+        Free(conn->buf);
+
+    conn->state = CONN_CLOSED;
+    conn->next_closed = closed_conns;
+    closed_conns = conn;
+}
+
+
+/* SetDeadline - Give the origin of conn ms from now to connect or send */
+static void SetDeadline(Conn *conn, long ms)
+{
+    Loop *loop = conn->loop;
+
+    if (conn->deadline == 0)
+    {
+        conn->prev_timed = NULL;
+        conn->next_timed = loop->timed;
+        if (loop->timed != NULL)
+            loop->timed->prev_timed = conn;
+        loop->timed = conn;
+    }
+    conn->deadline = NowMs() + ms;
+}
+
+
+static void ClearDeadline(Conn *conn)
+{
+    if (conn->deadline == 0)
+        return;
+
+    if (conn->prev_timed != NULL)
+        conn->prev_timed->next_timed = conn->next_timed;
+    else
+        conn->loop->timed = conn->next_timed;
+    if (conn->next_timed != NULL)
+        conn->next_timed->prev_timed = conn->prev_timed;
+    conn->deadline = 0;
+}
+
+
+/*
+ * ExpireConns - Give up on the conns whose origin missed its deadline. A
+ *     client that has had none of the response yet gets a 504, as from
+ *     FetchResponse, one that has can only be told by closing. The conns
+ *     waiting for a slot try again for one, each DEADLINE_TICK.
+ */
+static void ExpireConns(Loop *loop)
+{
+    long now = NowMs();
+    Conn *next;
+
+    for (Conn *conn = loop->timed; conn != NULL; conn = next)
+    {
+        next = conn->next_timed;
+        if (conn->state == CONN_WAIT_SLOT && conn->deadline > now
+            && TakeOriginSlot(conn->origin.host, conn->origin.port))
+        {
+            /* Connecting has a deadline of its own, see StartFetch */
+            ClearDeadline(conn);
+            conn->has_slot = 1;
+            StartFetch(conn);
+            continue;
+        }
+        if (conn->deadline > now)
+            continue;
+
+        if (conn->state != CONN_RELAY || (conn->req_len == 0 && !conn->head_done))
+            GatewayTimeout(conn->client.fd);
+        else
+            LOG(LOG_WARN, "Origin stalled on %s", conn->uri);
+        CloseConn(conn);
+    }
+}
+
+
+static long NowMs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,268 @@
+/*
+ * fresh.c - Freshness of cached responses. The lifetime of a response is
+ *     read from its Cache-Control, Expires and Date headers, or guessed
+ *     from Last-Modified, and an entry is served without asking the
+ *     origin until it runs out. A stale entry is then revalidated with a
+ *     conditional request built from the validators of its cached head,
+ *     and a 304 renews it without the body being sent again. A hot entry
+ *     may go on being served for a short window past its lifetime, while
+ *     it is refreshed in the background.
+ */
+#define _GNU_SOURCE             /* strptime(), timegm() */
+#include "fresh.h"
+
+
+static char *CopyValue(char *out, char *p);
+static void ScanCacheControl(Freshness *fresh, char *value);
+static time_t ParseHttpDate(char *value);
+
+
+void InitFreshness(Freshness *fresh)
+{
+    fresh->max_age = -1;
+    fresh->s_maxage = -1;
+    fresh->expires = -1;
+    fresh->date = -1;
+    fresh->last_modified = -1;
+    fresh->age = 0;
+    fresh->no_store = 0;
+    fresh->no_cache = 0;
+    fresh->stale_while_revalidate = -1;
+    fresh->must_revalidate = 0;
+}
+
+
+/*
+ * ScanFreshness - Note what line, a header line of a response, says of
+ *     its freshness. line need not end after its CRLF, the head it is
+ *     in may follow.
+ */
+void ScanFreshness(Freshness *fresh, char *line)
+{
+    char value[MAXLINE];
+
+    if (!strncasecmp(line, "Cache-Control:", 14))
+    {
+        ScanCacheControl(fresh, CopyValue(value, line + 14));
+    }
+    else if (!strncasecmp(line, "Expires:", 8))
+    {
+        /* An invalid date, such as "0", means already expired */
+        if ((fresh->expires = ParseHttpDate(CopyValue(value, line + 8))) < 0)
+            fresh->expires = 0;
+    }
+    else if (!strncasecmp(line, "Date:", 5))
+    {
+        fresh->date = ParseHttpDate(CopyValue(value, line + 5));
+    }
+    else if (!strncasecmp(line, "Last-Modified:", 14))
+    {
+        fresh->last_modified = ParseHttpDate(CopyValue(value, line + 14));
+    }
+    else if (!strncasecmp(line, "Age:", 4))
+    {
+        fresh->age = strtol(line + 4, NULL, 10);
+    }
+}
+
+
+/*
+ * FreshnessLifetime - Return the seconds a response with the headers
+ *     scanned into fresh stays fresh from now, or -1 if it must not be
+ *     cached at all. s-maxage, max-age and Expires are taken in that
+ *     order, then the Last-Modified heuristic, then fallback.
+ */
+long FreshnessLifetime(Freshness *fresh, long fallback)
+{
+    time_t now = time(NULL);
+    time_t date = fresh->date >= 0 ? fresh->date : now;
+    long lifetime;
+
+    if (fresh->no_store)
+        return -1;
+
+    if (fresh->no_cache)
+        lifetime = 0;
+    else if (fresh->s_maxage >= 0)
+        lifetime = fresh->s_maxage;
+    else if (fresh->max_age >= 0)
+        lifetime = fresh->max_age;
+    else if (fresh->expires >= 0)
+        lifetime = fresh->expires - date;
+    else if (fresh->last_modified >= 0 && fresh->last_modified <= date)
+    {
+        lifetime = (date - fresh->last_modified) * HEURISTIC_PERCENT / 100;
+        if (lifetime > HEURISTIC_MAX)
+            lifetime = HEURISTIC_MAX;
+    }
+    else
+        lifetime = fallback;
+
+    lifetime -= fresh->age;
+    return lifetime > 0 ? lifetime : 0;
+}
+
+
+/*
+ * ResponseLifetime - FreshnessLifetime of a response with status, to be
+ *     cached anew. Only the statuses cacheable by default get the
+ *     Last-Modified heuristic or DEFAULT_FRESHNESS. Any other, say a 503,
+ *     is cached only for a lifetime it states, and otherwise not at all.
+ */
+long ResponseLifetime(Freshness *fresh, int status)
+{
+    static const int by_default[] = { 200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501 };
+
+    for (size_t i = 0; i < sizeof(by_default) / sizeof(by_default[0]); i++)
+    {
+        if (status == by_default[i])
+            return FreshnessLifetime(fresh, DEFAULT_FRESHNESS);
+    }
+    if (fresh->s_maxage < 0 && fresh->max_age < 0 && fresh->expires < 0)
+        return -1;
+    return FreshnessLifetime(fresh, DEFAULT_FRESHNESS);
+}
+
+
+/*
+ * StaleWindow - Return the seconds past its lifetime a response with the
+ *     headers scanned into fresh may be served while refreshed, none if
+ *     it must be revalidated before every use once stale.
+ */
+long StaleWindow(Freshness *fresh)
+{
+    if (fresh->no_cache || fresh->must_revalidate)
+        return 0;
+    if (fresh->stale_while_revalidate < 0)
+        return DEFAULT_STALE_WINDOW;
+    if (fresh->stale_while_revalidate > MAX_STALE_WINDOW)
+        return MAX_STALE_WINDOW;
+    return fresh->stale_while_revalidate;
+}
+
+
+/*
+ * RenewFreshness - Make entry fresh for lifetime seconds from now. The
+ *     entry may be linked and read meanwhile, the store is atomic.
+ */
+void RenewFreshness(CacheEntry *entry, long lifetime)
+{
+    __atomic_store_n(&entry->fresh_until, time(NULL) + lifetime, __ATOMIC_RELAXED);
+}
+
+
+int IsFresh(CacheEntry *entry)
+{
+    return __atomic_load_n(&entry->fresh_until, __ATOMIC_RELAXED) > time(NULL);
+}
+
+
+/*
+ * CanServeStale - Whether entry, found stale, may still be served while
+ *     it is refreshed: it is hot, and within its stale window. A cold
+ *     entry is revalidated first, as no load waits on it.
+ */
+int CanServeStale(CacheEntry *entry)
+{
+    time_t fresh_until = __atomic_load_n(&entry->fresh_until, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(&entry->hits, __ATOMIC_RELAXED) >= HOT_HITS
+        && fresh_until + entry->stale_window > time(NULL);
+}
+
+
+/*
+ * FormatValidators - Write into out, 2 * MAXLINE bytes, the header lines
+ *     of a conditional request for entry: If-None-Match with the ETag of
+ *     its head, If-Modified-Since with its Last-Modified. Returns their
+ *     length, 0 if the head has neither.
+ */
+int FormatValidators(char *out, CacheEntry *entry)
+{
+    char *line = entry->obj, *end = entry->obj + entry->head_len;
+    int len = 0;
+
+    out[0] = '\0';
+    while (line < end)
+    {
+        char *eol = memchr(line, '\n', end - line);
+        char *next = eol != NULL ? eol + 1 : end;
+        char *name = NULL;
+        int skip = 0;
+
+        if (!strncasecmp(line, "ETag:", 5))
+        {
+            name = "If-None-Match:";
+            skip = 5;
+        }
+        else if (!strncasecmp(line, "Last-Modified:", 14))
+        {
+            name = "If-Modified-Since:";
+            skip = 14;
+        }
+
+        /* The value keeps the line's own line ending */
+        if (name != NULL && eol != NULL && next - line - skip < MAXLINE - 32)
+            len += sprintf(out + len, "%s%.*s", name, (int) (next - line - skip), line + skip);
+        line = next;
+    }
+    return len;
+}
+
+
+/* CopyValue - Copy the header value at p, up to its line end, into out */
+static char *CopyValue(char *out, char *p)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    size_t n = strcspn(p, "\r\n");
+    if (n > MAXLINE - 1)
+        n = MAXLINE - 1;
+    memcpy(out, p, n);
+    out[n] = '\0';
+    return out;
+}
+
+
+/*
+ * ScanCacheControl - Note the directives of a Cache-Control value. Those
+ *     with a field list, no-cache="Set-Cookie" say, are taken as applying
+ *     to the whole response, and private as no-store: the proxy's cache
+ *     is shared.
+ */
+static void ScanCacheControl(Freshness *fresh, char *value)
+{
+    char *save;
+
+    for (char *tok = strtok_r(value, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+
+        if (!strncasecmp(tok, "max-age=", 8))
+            fresh->max_age = strtol(tok + 8, NULL, 10);
+        else if (!strncasecmp(tok, "s-maxage=", 9))
+            fresh->s_maxage = strtol(tok + 9, NULL, 10);
+        else if (!strncasecmp(tok, "no-store", 8) || !strncasecmp(tok, "private", 7))
+            fresh->no_store = 1;
+        else if (!strncasecmp(tok, "no-cache", 8))
+            fresh->no_cache = 1;
+        else if (!strncasecmp(tok, "stale-while-revalidate=", 23))
+            fresh->stale_while_revalidate = strtol(tok + 23, NULL, 10);
+        else if (!strncasecmp(tok, "must-revalidate", 15)
+                 || !strncasecmp(tok, "proxy-revalidate", 16))
+            fresh->must_revalidate = 1;
+    }
+}
+
+
+/* ParseHttpDate - Parse an IMF-fixdate, or return -1 */
+static time_t ParseHttpDate(char *value)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        return -1;
+    return timegm(&tm);
+}
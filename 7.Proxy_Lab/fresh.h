@@ -0,0 +1,60 @@
+#ifndef __FRESH_H__
+#define __FRESH_H__
+
+#include <time.h>
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Seconds a response that says nothing of its lifetime stays fresh */
+#define DEFAULT_FRESHNESS 60
+
+/*
+ * A response with only Last-Modified stays fresh for this share of the
+ * time it had gone unmodified, up to HEURISTIC_MAX seconds
+ */
+#define HEURISTIC_PERCENT 10
+#define HEURISTIC_MAX 86400
+
+/*
+ * Seconds past its lifetime a hot entry is still served while it is
+ * refreshed in the background, unless the response says otherwise with
+ * stale-while-revalidate, which is held to MAX_STALE_WINDOW
+ */
+#define DEFAULT_STALE_WINDOW 10
+#define MAX_STALE_WINDOW 300
+
+/* Hits, counting the one at hand, that make an entry hot */
+#define HOT_HITS 2
+
+
+/*
+ * What the headers of a response say of how long it may be cached. Times
+ * are -1 where the header is missing.
+ */
+typedef struct
+{
+    long max_age;
+    long s_maxage;                  /* Overrides max_age in a shared cache */
+    time_t expires;
+    time_t date;
+    time_t last_modified;
+    long age;                       /* Seconds spent in caches before us */
+    int no_store;                   /* no-store, or private */
+    int no_cache;                   /* Cacheable, but revalidated every time */
+    long stale_while_revalidate;
+    int must_revalidate;            /* must-revalidate, or proxy-revalidate */
+} Freshness;
+
+
+void InitFreshness(Freshness *fresh);
+void ScanFreshness(Freshness *fresh, char *line);
+long FreshnessLifetime(Freshness *fresh, long fallback);
+long ResponseLifetime(Freshness *fresh, int status);
+long StaleWindow(Freshness *fresh);
+void RenewFreshness(CacheEntry *entry, long lifetime);
+int IsFresh(CacheEntry *entry);
+int CanServeStale(CacheEntry *entry);
+int FormatValidators(char *out, CacheEntry *entry);
+
+#endif /* __FRESH_H__ */
@@ -0,0 +1,771 @@
+/*
+ * gzip.c - Compressed variants of cached text objects. A text body is
+ *     compressed once, before its fill is published, into an entry of its
+ *     own next to the one keeping the body as received: clients accepting
+ *     gzip are sent the variant as cached, others and ranges the body as
+ *     received, neither of them inflated or copied. The codec is bundled:
+ *     a deflate of LZ77 matches over the fixed Huffman codes, and an
+ *     inflate reading any deflate stream, both in the gzip format.
+ */
+#define _GNU_SOURCE             /* strcasestr() */
+#include "disk.h"
+#include "gzip.h"
+#include "hash.h"
+#include "log.h"
+
+/* Heads of the match chains, by a hash of 3 bytes, a power of 2 */
+#define HASH_SIZE 32768
+
+
+/* Bits written least significant first, into a bounded buffer */
+typedef struct
+{
+    unsigned char *out;
+    size_t cap;
+    size_t len;
+    unsigned long bits;
+    int nbits;
+    int full;                       /* Set once a byte did not fit */
+} BitWriter;
+
+
+/* A deflate stream being read, and the bytes it inflated to so far */
+typedef struct
+{
+    unsigned char *in;
+    size_t len;
+    size_t pos;
+    unsigned long bits;
+    int nbits;
+    unsigned char *out;
+    size_t cap;
+    size_t out_len;
+} Inflater;
+
+
+/* A canonical Huffman code, as the count of codes of each length and
+   the symbols in code order */
+typedef struct
+{
+    short count[16];
+    short symbol[288];
+} Huffman;
+
+
+static void PutBits(BitWriter *w, unsigned long value, int n);
+static void PutHuffman(BitWriter *w, int code, int len);
+static void PutLiteral(BitWriter *w, int sym);
+static void PutMatch(BitWriter *w, int length, int dist);
+static unsigned int Hash3(unsigned char *p);
+static int GetBits(Inflater *s, int n);
+static int Decode(Inflater *s, Huffman *h);
+static int BuildHuffman(Huffman *h, short *length, int n);
+static int InflateStored(Inflater *s);
+static int InflateFixed(Inflater *s);
+static int InflateDynamic(Inflater *s);
+static int InflateCodes(Inflater *s, Huffman *lencode, Huffman *distcode);
+static unsigned int Crc32(unsigned char *p, size_t n);
+static void InitCrcTable(void);
+static void GzipKey(char *out, CacheEntry *entry);
+static int CompressVariant(CacheEntry *variant, CacheEntry *entry);
+static int FillVariant(CacheEntry *variant, CacheEntry *entry, char *gzip, size_t n);
+static int IsCompressible(char *head, size_t head_len);
+static char *FindStrongETag(char *head, size_t head_len);
+
+
+/* Length symbols 257 to 285, and distance symbols: bases, extra bits */
+static const short length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+/* The order code lengths of the code length code are sent in */
+static const unsigned char code_length_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * GzipCompress - Compress len bytes at in into out, in the gzip format.
+ *     Returns the compressed length, or 0 if it does not fit in cap bytes,
+ *     which is found out early for a body that does not compress.
+ */
+size_t GzipCompress(char *out, size_t cap, char *in, size_t len)
+{
+    static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    unsigned char *src = (unsigned char *) in;
+    BitWriter w = { (unsigned char *) out, cap, 0, 0, 0, 0 };
+    size_t i = 0;
+
+    if (cap < sizeof(header) + 8)
+        return 0;
+    memcpy(out, header, sizeof(header));
+    w.len = sizeof(header);
+
+    int *head = Malloc(HASH_SIZE * sizeof(int));
+    int *prev = Malloc((len + 1) * sizeof(int));
+    memset(head, -1, HASH_SIZE * sizeof(int));
+
+    /* A single final block with the fixed codes */
+    PutBits(&w, 1, 1);
+    PutBits(&w, 1, 2);
+    while (i < len && !w.full)
+    {
+        size_t best_len = 0, best_dist = 0;
+
+        if (i + 2 < len)
+        {
+            size_t max = len - i < 258 ? len - i : 258;
+            unsigned int h = Hash3(src + i);
+            int chain = GZIP_MAX_CHAIN;
+
+            for (int j = head[h]; j >= 0 && i - j <= GZIP_WINDOW && chain-- > 0; j = prev[j])
+            {
+                size_t n = 0;
+                while (n < max && src[j + n] == src[i + n])
+                    n++;
+                if (n > best_len)
+                {
+                    best_len = n;
+                    best_dist = i - j;
+                    if (n == max)
+                        break;
+                }
+            }
+            prev[i] = head[h];
+            head[h] = i;
+        }
+
+        if (best_len < 3)
+        {
+            PutLiteral(&w, src[i++]);
+            continue;
+        }
+        PutMatch(&w, best_len, best_dist);
+
+        /* The positions a match covers may start later ones */
+        for (size_t k = i + 1; k < i + best_len && k + 2 < len; k++)
+        {
+            unsigned int h = Hash3(src + k);
+            prev[k] = head[h];
+            head[h] = k;
+        }
+        i += best_len;
+    }
+    PutLiteral(&w, 256);
+    if (w.nbits > 0)
+        PutBits(&w, 0, 8 - w.nbits);
+    Free(head);
+    Free(prev);
+
+    /* The trailer, CRC-32 and length of the input, little endian */
+    unsigned int crc = Crc32(src, len);
+    for (int k = 0; k < 32; k += 8)
+        PutBits(&w, (crc >> k) & 0xff, 8);
+    for (int k = 0; k < 32; k += 8)
+        PutBits(&w, (len >> k) & 0xff, 8);
+    return w.full ? 0 : w.len;
+}
+
+
+/*
+ * GzipInflate - Inflate the gzip stream of len bytes at in into out.
+ *     Returns the inflated length, or -1 if the stream is malformed, fails
+ *     its check, or inflates to more than cap bytes.
+ */
+long GzipInflate(char *out, size_t cap, char *in, size_t len)
+{
+    unsigned char *p = (unsigned char *) in;
+    size_t pos = 10;
+    int last;
+
+    if (len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8)
+        return -1;
+
+    /* Skip the optional fields: extra, name, comment, header CRC */
+    if (p[3] & 4)
+        pos += 2 + (p[pos] | p[pos + 1] << 8);
+    if (p[3] & 8)
+        while (pos < len && p[pos++] != 0)
+            ;
+    if (p[3] & 16)
+        while (pos < len && p[pos++] != 0)
+            ;
+    if (p[3] & 2)
+        pos += 2;
+    if (pos + 8 > len)
+        return -1;
+
+    Inflater s = { p, len - 8, pos, 0, 0, (unsigned char *) out, cap, 0 };
+    do
+    {
+        int type, rc = -1;
+
+        if ((last = GetBits(&s, 1)) < 0 || (type = GetBits(&s, 2)) < 0)
+            return -1;
+        if (type == 0)
+            rc = InflateStored(&s);
+        else if (type == 1)
+            rc = InflateFixed(&s);
+        else if (type == 2)
+            rc = InflateDynamic(&s);
+        if (rc < 0)
+            return -1;
+    } while (!last);
+
+    unsigned char *t = p + len - 8;
+    unsigned int crc = t[0] | t[1] << 8 | t[2] << 16 | (unsigned int) t[3] << 24;
+    unsigned int size = t[4] | t[5] << 8 | t[6] << 16 | (unsigned int) t[7] << 24;
+    if (crc != Crc32(s.out, s.out_len) || size != (unsigned int) s.out_len)
+        return -1;
+    return s.out_len;
+}
+
+
+/*
+ * CompressCacheFill - Cache the gzip variant of fill, a complete response
+ *     not yet published, if it is text that shrinks by 1/GZIP_MIN_SAVING
+ *     at least. fill keeps its body as received, its head gains
+ *     GZIP_VARY_HEADER, and gzip_size the length of the variant's body.
+ *     Both are charged to the cache, see ReadGzipVariant.
+ */
+void CompressCacheFill(CacheEntry *fill)
+{
+    CacheEntry *variant, *pending;
+    char key[GZIP_KEY_SIZE];
+    size_t body_len = fill->obj_size - fill->head_len;
+    size_t vary = strlen(GZIP_VARY_HEADER);
+
+    if (fill->chunked_size > 0 || body_len < GZIP_MIN_SIZE
+        || !IsCompressible(fill->obj, fill->head_len))
+        return;
+
+    size_t cap = body_len - body_len / GZIP_MIN_SAVING;
+    char *gzip = Malloc(cap);
+    size_t n = GzipCompress(gzip, cap, fill->obj + fill->head_len, body_len);
+    if (n == 0)
+    {
+        Free(gzip);
+        return;
+    }
+
+    /* The body moves up past the header added to the head */
+    if (fill->obj_size + vary > fill->obj_cap)
+    {
+        fill->obj_cap = fill->obj_size + vary;
+        fill->obj = Realloc(fill->obj, fill->obj_cap);
+    }
+    memmove(fill->obj + fill->head_len + vary, fill->obj + fill->head_len, body_len);
+    memcpy(fill->obj + fill->head_len, GZIP_VARY_HEADER, vary);
+    fill->head_len += vary;
+    fill->obj_size += vary;
+    fill->gzip_size = n;
+
+    /* Another fill of the same response may have cached it already */
+    GzipKey(key, fill);
+    if ((variant = PollCacheOrFill(key, &pending)) != NULL)
+        ReleaseCacheEntry(variant);
+    else if (pending != NULL && FillVariant(pending, fill, gzip, n) == 0)
+        PublishCacheFill(pending);
+    Free(gzip);
+    LOG(LOG_DEBUG, "Compressed %s from %lu to %lu bytes", fill->uri, body_len, n);
+}
+
+
+/*
+ * ReadGzipVariant - Return the gzip variant of entry, a cached response,
+ *     pinned, or NULL if it has none. A variant the cache lost is read
+ *     back from the disk tier, or compressed again, by the first client
+ *     missing it; others meanwhile go without.
+ */
+CacheEntry *ReadGzipVariant(CacheEntry *entry)
+{
+    CacheEntry *variant, *fill;
+    char key[GZIP_KEY_SIZE];
+
+    if (entry->gzip_size == 0)
+        return NULL;
+
+    GzipKey(key, entry);
+    if ((variant = PollCacheOrFill(key, &fill)) == NULL && fill != NULL)
+    {
+        if (ReadDiskCache(fill) < 0 && CompressVariant(fill, entry) < 0)
+            return NULL;
+        variant = PinCacheEntry(fill);
+        PublishCacheFill(fill);
+    }
+
+    if (variant != NULL && variant->obj_size - variant->head_len != entry->gzip_size)
+    {
+        LOG(LOG_WARN, "Cached gzip variant of %s does not match it", entry->uri);
+        ReleaseCacheEntry(variant);
+        return NULL;
+    }
+    return variant;
+}
+
+
+/*
+ * AcceptsGzip - Whether value, an Accept-Encoding header or NULL if the
+ *     request had none, takes gzip: it names gzip, and not with q=0.
+ */
+int AcceptsGzip(HttpSlice *value)
+{
+    char buf[MAXLINE], *save;
+
+    if (value == NULL)
+        return 0;
+    HttpSliceCopy(buf, sizeof(buf), *value);
+    for (char *tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        tok += strspn(tok, " \t");
+        size_t n = strcspn(tok, " \t;");
+
+        if ((n == 4 && !strncasecmp(tok, "gzip", 4)) || (n == 6 && !strncasecmp(tok, "x-gzip", 6)))
+        {
+            char *q = strstr(tok + n, "q=");
+            return q == NULL || strtod(q + 2, NULL) > 0;
+        }
+    }
+    return 0;
+}
+
+
+static void PutBits(BitWriter *w, unsigned long value, int n)
+{
+    w->bits |= value << w->nbits;
+    w->nbits += n;
+    while (w->nbits >= 8)
+    {
+        if (w->len < w->cap)
+            w->out[w->len++] = w->bits & 0xff;
+        else
+            w->full = 1;
+        w->bits >>= 8;
+        w->nbits -= 8;
+    }
+}
+
+
+/* PutHuffman - Write a Huffman code, which goes most significant bit first */
+static void PutHuffman(BitWriter *w, int code, int len)
+{
+    int reversed = 0;
+
+    for (int i = 0; i < len; i++, code >>= 1)
+        reversed = (reversed << 1) | (code & 1);
+    PutBits(w, reversed, len);
+}
+
+
+/* PutLiteral - Write a literal/length symbol in the fixed code */
+static void PutLiteral(BitWriter *w, int sym)
+{
+    if (sym < 144)
+        PutHuffman(w, 0x30 + sym, 8);
+    else if (sym < 256)
+        PutHuffman(w, 0x190 + sym - 144, 9);
+    else if (sym < 280)
+        PutHuffman(w, sym - 256, 7);
+    else
+        PutHuffman(w, 0xc0 + sym - 280, 8);
+}
+
+
+static void PutMatch(BitWriter *w, int length, int dist)
+{
+    int i = 28;
+
+    while (length_base[i] > length)
+        i--;
+    PutLiteral(w, 257 + i);
+    PutBits(w, length - length_base[i], length_extra[i]);
+
+    i = 29;
+    while (dist_base[i] > dist)
+        i--;
+    PutHuffman(w, i, 5);
+    PutBits(w, dist - dist_base[i], dist_extra[i]);
+}
+
+
+static unsigned int Hash3(unsigned char *p)
+{
+    return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+
+/* GetBits - Read n bits, or return -1 at the end of the stream */
+static int GetBits(Inflater *s, int n)
+{
+    while (s->nbits < n)
+    {
+        if (s->pos == s->len)
+            return -1;
+        s->bits |= (unsigned long) s->in[s->pos++] << s->nbits;
+        s->nbits += 8;
+    }
+
+    int value = s->bits & ((1UL << n) - 1);
+    s->bits >>= n;
+    s->nbits -= n;
+    return value;
+}
+
+
+/* Decode - Read a symbol of the code h, a bit at a time, or return -1 */
+static int Decode(Inflater *s, Huffman *h)
+{
+    int code = 0, first = 0, index = 0;
+
+    for (int len = 1; len < 16; len++)
+    {
+        int bit = GetBits(s, 1);
+        if (bit < 0)
+            return -1;
+        code |= bit;
+
+        int count = h->count[len];
+        if (code - first < count)
+            return h->symbol[index + code - first];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+
+/*
+ * BuildHuffman - Build the code of n symbols from their code lengths, 0
+ *     for a symbol not used. Returns -1 if the lengths over-subscribe the
+ *     code, otherwise how many codes it leaves unused, 0 for a complete one.
+ */
+static int BuildHuffman(Huffman *h, short *length, int n)
+{
+    short offs[16];
+    int left = 1;
+
+    memset(h->count, 0, sizeof(h->count));
+    for (int i = 0; i < n; i++)
+        h->count[length[i]]++;
+    if (h->count[0] == n)
+        return 0;
+
+    for (int len = 1; len < 16; len++)
+    {
+        left = (left << 1) - h->count[len];
+        if (left < 0)
+            return -1;
+    }
+
+    offs[1] = 0;
+    for (int len = 1; len < 15; len++)
+        offs[len + 1] = offs[len] + h->count[len];
+    for (int i = 0; i < n; i++)
+    {
+        if (length[i] != 0)
+            h->symbol[offs[length[i]]++] = i;
+    }
+    return left;
+}
+
+
+static int InflateStored(Inflater *s)
+{
+    /* The block starts at the next byte */
+    s->bits = 0;
+    s->nbits = 0;
+    if (s->pos + 4 > s->len)
+        return -1;
+
+    size_t len = s->in[s->pos] | s->in[s->pos + 1] << 8;
+    size_t nlen = s->in[s->pos + 2] | s->in[s->pos + 3] << 8;
+    s->pos += 4;
+    if (len != (~nlen & 0xffff) || s->pos + len > s->len || len > s->cap - s->out_len)
+        return -1;
+
+    memcpy(s->out + s->out_len, s->in + s->pos, len);
+    s->pos += len;
+    s->out_len += len;
+    return 0;
+}
+
+
+static int InflateFixed(Inflater *s)
+{
+    short length[288];
+    Huffman lencode, distcode;
+    int sym = 0;
+
+    for (; sym < 144; sym++)
+        length[sym] = 8;
+    for (; sym < 256; sym++)
+        length[sym] = 9;
+    for (; sym < 280; sym++)
+        length[sym] = 7;
+    for (; sym < 288; sym++)
+        length[sym] = 8;
+    BuildHuffman(&lencode, length, 288);
+
+    for (sym = 0; sym < 30; sym++)
+        length[sym] = 5;
+    BuildHuffman(&distcode, length, 30);
+    return InflateCodes(s, &lencode, &distcode);
+}
+
+
+/*
+ * InflateDynamic - Inflate a block with codes of its own, sent up front
+ *     as code lengths, themselves in a code sent before them.
+ */
+static int InflateDynamic(Inflater *s)
+{
+    short length[286 + 30];
+    Huffman lencode, distcode;
+    int nlen, ndist, ncode, index = 0;
+
+    if ((nlen = GetBits(s, 5)) < 0 || (ndist = GetBits(s, 5)) < 0 || (ncode = GetBits(s, 4)) < 0)
+        return -1;
+    nlen += 257;
+    ndist += 1;
+    ncode += 4;
+    if (nlen > 286 || ndist > 30)
+        return -1;
+
+    for (int i = 0; i < 19; i++)
+    {
+        int len = i < ncode ? GetBits(s, 3) : 0;
+        if (len < 0)
+            return -1;
+        length[code_length_order[i]] = len;
+    }
+    if (BuildHuffman(&lencode, length, 19) != 0)
+        return -1;
+
+    while (index < nlen + ndist)
+    {
+        int sym = Decode(s, &lencode), repeat, len = 0;
+
+        if (sym < 0)
+            return -1;
+        if (sym < 16)
+        {
+            length[index++] = sym;
+            continue;
+        }
+
+        if (sym == 16)
+        {
+            if (index == 0)
+                return -1;
+            len = length[index - 1];
+            repeat = GetBits(s, 2) + 3;
+        }
+        else if (sym == 17)
+            repeat = GetBits(s, 3) + 3;
+        else
+            repeat = GetBits(s, 7) + 11;
+        if (repeat < 3 || index + repeat > nlen + ndist)
+            return -1;
+        while (repeat-- > 0)
+            length[index++] = len;
+    }
+
+    /* There must be an end of block code */
+    if (length[256] == 0)
+        return -1;
+    if (BuildHuffman(&lencode, length, nlen) < 0
+        || BuildHuffman(&distcode, length + nlen, ndist) < 0)
+        return -1;
+    return InflateCodes(s, &lencode, &distcode);
+}
+
+
+/* InflateCodes - Inflate the symbols of a block up to its end of block */
+static int InflateCodes(Inflater *s, Huffman *lencode, Huffman *distcode)
+{
+    int sym;
+
+    while ((sym = Decode(s, lencode)) != 256)
+    {
+        if (sym < 0)
+            return -1;
+        if (sym < 256)
+        {
+            if (s->out_len == s->cap)
+                return -1;
+            s->out[s->out_len++] = sym;
+            continue;
+        }
+
+        int extra;
+        if ((sym -= 257) >= 29 || (extra = GetBits(s, length_extra[sym])) < 0)
+            return -1;
+        size_t length = length_base[sym] + extra;
+        if ((sym = Decode(s, distcode)) < 0 || sym >= 30
+            || (extra = GetBits(s, dist_extra[sym])) < 0)
+            return -1;
+        size_t dist = dist_base[sym] + extra;
+        if (dist > s->out_len || length > s->cap - s->out_len)
+            return -1;
+
+        /* A match may overlap the bytes it produces */
+        for (; length > 0; length--, s->out_len++)
+            s->out[s->out_len] = s->out[s->out_len - dist];
+    }
+    return 0;
+}
+
+
+static unsigned int Crc32(unsigned char *p, size_t n)
+{
+    unsigned int crc = 0xffffffff;
+
+    pthread_once(&crc_once, InitCrcTable);
+    while (n-- > 0)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+
+static void InitCrcTable(void)
+{
+    for (unsigned int n = 0; n < 256; n++)
+    {
+        unsigned int c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+
+/*
+ * GzipKey - Write into out, GZIP_KEY_SIZE bytes, the cache key of the gzip
+ *     variant of entry. It holds a hash of the head, so a newer response
+ *     cached for the uri does not find the variant of an older one.
+ */
+static void GzipKey(char *out, CacheEntry *entry)
+{
+    unsigned long hash = HashBytes(FNV_OFFSET, entry->obj, entry->head_len);
+
+    sprintf(out, "%s gzip/%lx", entry->uri, hash);
+}
+
+
+/*
+ * CompressVariant - Compress the body of entry, which has a gzip variant,
+ *     again into variant, a pending entry. Returns 0, or -1 with variant
+ *     freed if it does not compress to gzip_size bytes as before.
+ */
+static int CompressVariant(CacheEntry *variant, CacheEntry *entry)
+{
+    char *gzip = Malloc(entry->gzip_size);
+    size_t n = GzipCompress(gzip, entry->gzip_size, entry->obj + entry->head_len,
+                            entry->obj_size - entry->head_len);
+    int rc = -1;
+
+    if (n == entry->gzip_size)
+        rc = FillVariant(variant, entry, gzip, n);
+    else
+        AbortCacheFill(variant);
+    Free(gzip);
+    return rc;
+}
+
+
+/*
+ * FillVariant - Write into variant, a pending entry, the gzip variant of
+ *     entry, with the n bytes at gzip as its body. Its head is that of
+ *     entry with a strong ETag weakened, as the two bodies are not the
+ *     same bytes, and a client must not resume a range of one from the
+ *     other. Returns 0, or -1 with variant freed if it cannot be cached.
+ */
+static int FillVariant(CacheEntry *variant, CacheEntry *entry, char *gzip, size_t n)
+{
+    char *etag = FindStrongETag(entry->obj, entry->head_len);
+    size_t weak = etag != NULL ? 2 : 0;
+    size_t at = etag != NULL ? (size_t) (etag - entry->obj) : entry->head_len;
+
+    if (!ReserveCacheFill(variant, entry->head_len + weak + n))
+        return -1;
+    AppendCacheFill(variant, entry->obj, at);
+    AppendCacheFill(variant, "W/", weak);
+    AppendCacheFill(variant, entry->obj + at, entry->head_len - at);
+    variant->head_len = variant->obj_size;
+    AppendCacheFill(variant, gzip, n);
+    variant->plain_size = entry->obj_size - entry->head_len;
+    variant->fresh_until = __atomic_load_n(&entry->fresh_until, __ATOMIC_RELAXED);
+    variant->lifetime = entry->lifetime;
+    variant->stale_window = entry->stale_window;
+    return 0;
+}
+
+
+/*
+ * IsCompressible - Whether the cached head, of head_len bytes, is that of
+ *     a 200 with a text body as received, which no header forbids to
+ *     transform: no Content-Encoding, no Vary we would have to merge with
+ *     ours, no Cache-Control no-transform.
+ */
+static int IsCompressible(char *head, size_t head_len)
+{
+    char line[MAXLINE];
+    char *p = head, *end = head + head_len;
+    int status = 0, text = 0;
+
+    while (p < end)
+    {
+        char *eol = memchr(p, '\n', end - p);
+        size_t len = (eol != NULL ? eol + 1 : end) - p;
+        size_t n = len < MAXLINE ? len : MAXLINE - 1;
+
+        memcpy(line, p, n);
+        line[n] = '\0';
+        if (p == head)
+        {
+            sscanf(line, "HTTP/1.%*d %d", &status);
+        }
+        else if (!strncasecmp(line, "Content-Type:", 13))
+        {
+            text = strcasestr(line + 13, "text/") || strcasestr(line + 13, "json")
+                || strcasestr(line + 13, "javascript") || strcasestr(line + 13, "xml");
+        }
+        else if (!strncasecmp(line, "Content-Encoding:", 17) || !strncasecmp(line, "Vary:", 5)
+                 || (!strncasecmp(line, "Cache-Control:", 14)
+                     && strcasestr(line + 14, "no-transform")))
+        {
+            return 0;
+        }
+        p += len;
+    }
+    return status == 200 && text;
+}
+
+
+/* FindStrongETag - Where the value of a strong ETag in head starts, or NULL */
+static char *FindStrongETag(char *head, size_t head_len)
+{
+    char *p = head, *end = head + head_len, *eol;
+
+    for (; p < end && (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1)
+    {
+        if (!strncasecmp(p, "ETag:", 5))
+        {
+            char *value = p + 5 + strspn(p + 5, " \t");
+            return *value == '"' ? value : NULL;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+
+/* Bodies shorter than this are cached as received, gzip would not pay */
+#define GZIP_MIN_SIZE 256
+
+/* A compressed body is only kept if it saves at least 1/GZIP_MIN_SAVING */
+#define GZIP_MIN_SAVING 8
+
+/* Positions the compressor looks back at for a match, and how far */
+#define GZIP_MAX_CHAIN 32
+#define GZIP_WINDOW 32768
+
+/*
+ * Header lines of an entry with a gzip variant, in the head of both, and
+ * sent with the body of the variant
+ */
+#define GZIP_VARY_HEADER "Vary: Accept-Encoding\r\n"
+#define GZIP_ENCODING_HEADER "Content-Encoding: gzip\r\n"
+
+/* Bytes of the cache key of a gzip variant, see GzipKey */
+#define GZIP_KEY_SIZE (MAXLINE + 32)
+
+
+size_t GzipCompress(char *out, size_t cap, char *in, size_t len);
+long GzipInflate(char *out, size_t cap, char *in, size_t len);
+void CompressCacheFill(CacheEntry *fill);
+CacheEntry *ReadGzipVariant(CacheEntry *entry);
+int AcceptsGzip(HttpSlice *value);
+
+#endif /* __GZIP_H__ */
@@ -0,0 +1,49 @@
+/*
+ * hash.c - FNV-1a, the one hash of the proxy: the cache, the disk tier,
+ *     the origin pool and the lookup cache all pick their buckets with
+ *     it, and the disk tier checks its records with the word variant.
+ */
+#include <string.h>
+
+#include "hash.h"
+
+
+/*
+ * HashBytes - Mix n bytes at buf into hash, FNV_OFFSET to start with, so
+ *     that several strings may be hashed as one
+ */
+unsigned long HashBytes(unsigned long hash, char *buf, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        hash = (hash ^ (unsigned char) buf[i]) * FNV_PRIME;
+    return hash;
+}
+
+
+unsigned long HashString(char *s)
+{
+    unsigned long hash = FNV_OFFSET;
+
+    for (unsigned char *p = (unsigned char *) s; *p; p++)
+        hash = (hash ^ *p) * FNV_PRIME;
+    return hash;
+}
+
+
+/*
+ * HashWords - FNV-1a over 8 byte words, then the bytes left. Not the hash
+ *     HashBytes gives, but eight times fewer multiplies over a whole object.
+ */
+unsigned long HashWords(char *buf, size_t n)
+{
+    unsigned long hash = FNV_OFFSET;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        unsigned long word;
+        memcpy(&word, buf + i, 8);
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+    return HashBytes(hash, buf + i, n - i);
+}
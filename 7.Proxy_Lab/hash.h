@@ -0,0 +1,15 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stddef.h>
+
+/* FNV-1a: the hash of no bytes, and the prime each byte is mixed in with */
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+
+unsigned long HashBytes(unsigned long hash, char *buf, size_t n);
+unsigned long HashString(char *s);
+unsigned long HashWords(char *buf, size_t n);
+
+#endif /* __HASH_H__ */
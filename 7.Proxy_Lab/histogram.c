@@ -0,0 +1,79 @@
+/*
+ * histogram.c - Log-linear latency histograms, recorded into by the proxy
+ *     and by loadgen.
+ */
+#include "histogram.h"
+
+
+void RecordHistogram(Histogram *hist, long value)
+{
+    int idx;
+
+    if (value < 0)
+        value = 0;
+    if (value < 2 * HIST_SUB)
+    {
+        idx = value;
+    }
+    else
+    {
+        /* Keep the top HIST_SUB_BITS + 1 bits of value */
+        int shift = 63 - __builtin_clzl(value) - HIST_SUB_BITS;
+        idx = (shift + 1) * HIST_SUB + (value >> shift) - HIST_SUB;
+    }
+    if (idx >= HIST_BUCKETS)
+        idx = HIST_BUCKETS - 1;
+
+    __atomic_store_n(&hist->counts[idx], hist->counts[idx] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->total, hist->total + 1, __ATOMIC_RELAXED);
+    if (value > hist->max)
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+
+/* MergeHistogram - Add the counts of from to into, which is not shared */
+void MergeHistogram(Histogram *into, Histogram *from)
+{
+    into->total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+        into->total += into->counts[i];
+    }
+
+    long max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max)
+        into->max = max;
+}
+
+
+/*
+ * HistogramPercentile - The least value at or below which a share p of
+ *     the counts lie, to the precision of its bucket.
+ */
+long HistogramPercentile(Histogram *hist, double p)
+{
+    unsigned long want = p * hist->total + 0.5, seen = 0;
+
+    if (want == 0)
+        want = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        if ((seen += hist->counts[i]) >= want)
+        {
+            long top = HistogramBucketValue(i + 1) - 1;
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+
+/* HistogramBucketValue - The least value counted in bucket idx */
+long HistogramBucketValue(int idx)
+{
+    if (idx < 2 * HIST_SUB)
+        return idx;
+    int shift = idx / HIST_SUB - 1;
+    return (long) (idx % HIST_SUB + HIST_SUB) << shift;
+}
@@ -0,0 +1,32 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+/*
+ * Latency histogram, in us, log-linear like HdrHistogram: values below
+ * 2 * HIST_SUB are counted exactly, larger ones in HIST_SUB buckets per
+ * power of 2, so every count is within 1/HIST_SUB of its value.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * 40)
+
+
+/*
+ * Only one thread records into a histogram, but others may merge it at
+ * any time, so counts are stored whole and a merge sees each count as
+ * it was at some point, if not all of them at the same point.
+ */
+typedef struct
+{
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    long max;
+} Histogram;
+
+
+void RecordHistogram(Histogram *hist, long value);
+void MergeHistogram(Histogram *into, Histogram *from);
+long HistogramPercentile(Histogram *hist, double p);
+long HistogramBucketValue(int idx);
+
+#endif /* __HISTOGRAM_H__ */
@@ -0,0 +1,263 @@
+/*
+ * http.c - Incremental HTTP/1.x request parser and message builder,
+ *     shared by the proxy and tiny. Requests are parsed in the buffer
+ *     they are read into, as slices of it, and requests to send are put
+ *     together as iovecs of slices and constant strings, so neither
+ *     copies a line of the message.
+ */
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+
+
+static int ParseRequestLine(HttpRequest *req, char *line, char *eol);
+static int ParseHeader(HttpRequest *req, char *line, char *eol);
+
+
+void HttpInitRequest(HttpRequest *req)
+{
+    req->header_cnt = 0;
+    req->line_cnt = 0;
+    req->parsed = 0;
+}
+
+
+/*
+ * HttpParseRequest - Parse the request head at the start of buf, of which
+ *     len bytes have been read. Call it again with the same buf as more
+ *     arrives, it picks up at the first line not parsed yet. Empty lines
+ *     before the request line are skipped. Returns the length of the head
+ *     once its blank line is in, HTTP_INCOMPLETE before, or HTTP_MALFORMED.
+ */
+ssize_t HttpParseRequest(HttpRequest *req, char *buf, size_t len)
+{
+    char *line = buf + req->parsed, *end = buf + len;
+    char *eol;
+
+    while ((eol = memchr(line, '\n', end - line)) != NULL)
+    {
+        char *next = eol + 1;
+
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        if (eol == line && req->line_cnt > 0)
+        {
+            req->parsed = next - buf;
+            return req->parsed;
+        }
+
+        if (eol != line)
+        {
+            int rc = req->line_cnt == 0 ? ParseRequestLine(req, line, eol)
+                                        : ParseHeader(req, line, eol);
+            if (rc < 0)
+                return HTTP_MALFORMED;
+            req->line_cnt++;
+        }
+
+        line = next;
+        req->parsed = next - buf;
+    }
+    return HTTP_INCOMPLETE;
+}
+
+
+/*
+ * HttpFindHeader - Return the value of the first header called name, or
+ *     NULL if the request has none.
+ */
+HttpSlice *HttpFindHeader(HttpRequest *req, char *name)
+{
+    for (int i = 0; i < req->header_cnt; i++)
+    {
+        if (!strcasecmp(req->headers[i].name.p, name))
+            return &req->headers[i].value;
+    }
+    return NULL;
+}
+
+
+/*
+ * HttpParseTarget - Split a request target, the absolute form a proxy is
+ *     sent, http://host[:port]/path, or the origin form, /path, into
+ *     out. The path of an absolute target without one is "/". Returns 0,
+ *     or -1 if target is neither.
+ */
+int HttpParseTarget(HttpSlice target, HttpTarget *out)
+{
+    char *p = target.p, *end = target.p + target.len;
+
+    memset(out, 0, sizeof(HttpTarget));
+    if (target.len > 0 && *p == '/')
+    {
+        out->path = target;
+        return 0;
+    }
+    if (target.len < 7 || strncasecmp(p, "http://", 7))
+        return -1;
+    p += 7;
+
+    char *slash = memchr(p, '/', end - p);
+    char *host_end = slash != NULL ? slash : end;
+    char *colon = NULL;
+
+    /* An IPv6 literal is bracketed, its colons are not the port's */
+    if (p < host_end && *p == '[')
+    {
+        char *close = memchr(p, ']', host_end - p);
+        if (close == NULL)
+            return -1;
+        out->host.p = p + 1;
+        out->host.len = close - p - 1;
+        if (close + 1 < host_end && close[1] == ':')
+            colon = close + 1;
+    }
+    else
+    {
+        colon = memchr(p, ':', host_end - p);
+        out->host.p = p;
+        out->host.len = (colon != NULL ? colon : host_end) - p;
+    }
+    if (out->host.len == 0)
+        return -1;
+    if (colon != NULL)
+    {
+        out->port.p = colon + 1;
+        out->port.len = host_end - colon - 1;
+    }
+
+    if (slash != NULL)
+    {
+        out->path.p = slash;
+        out->path.len = end - slash;
+    }
+    else
+    {
+        out->path.p = "/";
+        out->path.len = 1;
+    }
+    return 0;
+}
+
+
+/* HttpSliceHas - Whether s contains token, in any case */
+int HttpSliceHas(HttpSlice s, char *token)
+{
+    size_t n = strlen(token);
+
+    for (size_t i = 0; i + n <= s.len; i++)
+    {
+        if (!strncasecmp(s.p + i, token, n))
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * HttpSliceCopy - Copy s into out as a C string, cut to size - 1 bytes.
+ *     Returns out.
+ */
+char *HttpSliceCopy(char *out, size_t size, HttpSlice s)
+{
+    size_t n = s.len < size - 1 ? s.len : size - 1;
+
+    memcpy(out, s.p, n);
+    out[n] = '\0';
+    return out;
+}
+
+
+void HttpInitBuilder(HttpBuilder *b)
+{
+    b->cnt = 0;
+    b->len = 0;
+}
+
+
+/*
+ * HttpAdd - Append len bytes at p to the message. They are not copied,
+ *     and must stay put until it is sent.
+ */
+void HttpAdd(HttpBuilder *b, char *p, size_t len)
+{
+    if (len == 0)
+        return;
+    b->iov[b->cnt].iov_base = p;
+    b->iov[b->cnt].iov_len = len;
+    b->cnt++;
+    b->len += len;
+}
+
+
+void HttpAddString(HttpBuilder *b, char *s)
+{
+    HttpAdd(b, s, strlen(s));
+}
+
+
+void HttpAddSlice(HttpBuilder *b, HttpSlice s)
+{
+    HttpAdd(b, s.p, s.len);
+}
+
+
+/*
+ * ParseRequestLine - Parse "method target HTTP/1.x" from line up to eol,
+ *     ending method and target with a NUL in place of the space after.
+ */
+static int ParseRequestLine(HttpRequest *req, char *line, char *eol)
+{
+    char *sp1 = memchr(line, ' ', eol - line);
+    if (sp1 == NULL || sp1 == line)
+        return -1;
+    char *target = sp1 + 1;
+    char *sp2 = memchr(target, ' ', eol - target);
+    if (sp2 == NULL || sp2 == target)
+        return -1;
+    char *version = sp2 + 1;
+    if (eol - version != 8 || strncmp(version, "HTTP/1.", 7) || !isdigit(version[7]))
+        return -1;
+
+    req->method.p = line;
+    req->method.len = sp1 - line;
+    req->target.p = target;
+    req->target.len = sp2 - target;
+    req->minor = version[7] - '0';
+    *sp1 = '\0';
+    *sp2 = '\0';
+    return 0;
+}
+
+
+/*
+ * ParseHeader - Add the header "name: value" from line up to eol to the
+ *     table, ending name and value with a NUL. A line without a name,
+ *     such as an obsolete folded one, is refused, as is one header past
+ *     HTTP_MAX_HEADERS.
+ */
+static int ParseHeader(HttpRequest *req, char *line, char *eol)
+{
+    char *colon = memchr(line, ':', eol - line);
+
+    if (colon == NULL || colon == line || *line == ' ' || *line == '\t'
+        || req->header_cnt == HTTP_MAX_HEADERS)
+        return -1;
+
+    char *value = colon + 1, *end = eol;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    HttpHeader *h = &req->headers[req->header_cnt++];
+    h->name.p = line;
+    h->name.len = colon - line;
+    h->value.p = value;
+    h->value.len = end - value;
+    *colon = '\0';
+    *end = '\0';
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Headers a request may have, one with more is refused */
+#define HTTP_MAX_HEADERS 64
+
+/* Pieces an HttpBuilder holds, more than any head built here needs */
+#define HTTP_MAX_IOV 16
+
+/* Results of HttpParseRequest, besides the length of a complete head */
+#define HTTP_INCOMPLETE 0
+#define HTTP_MALFORMED -1
+
+
+/* Bytes of a message in the buffer it was read into, not copied out */
+typedef struct
+{
+    char *p;
+    size_t len;
+} HttpSlice;
+
+
+typedef struct
+{
+    HttpSlice name;
+    HttpSlice value;                /* Without surrounding whitespace */
+} HttpHeader;
+
+
+/*
+ * A request head parsed in place, in the buffer it is being read into.
+ * The parser ends method, target, header names and header values with a
+ * NUL where their delimiter was, so each is also a C string. It is fed
+ * the buffer again as more of the head arrives and only scans the bytes
+ * past the last whole line.
+ */
+typedef struct
+{
+    HttpSlice method;
+    HttpSlice target;
+    int minor;                      /* Of HTTP/1.minor */
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    int header_cnt;
+    int line_cnt;                   /* Lines parsed, the request line first */
+    size_t parsed;                  /* Bytes of the lines parsed */
+} HttpRequest;
+
+
+/* The parts of a request target, empty where it has none */
+typedef struct
+{
+    HttpSlice host;
+    HttpSlice port;
+    HttpSlice path;
+} HttpTarget;
+
+
+/* A message put together from pieces, to send with one writev */
+typedef struct
+{
+    struct iovec iov[HTTP_MAX_IOV];
+    int cnt;
+    size_t len;
+} HttpBuilder;
+
+
+void HttpInitRequest(HttpRequest *req);
+ssize_t HttpParseRequest(HttpRequest *req, char *buf, size_t len);
+HttpSlice *HttpFindHeader(HttpRequest *req, char *name);
+int HttpParseTarget(HttpSlice target, HttpTarget *out);
+int HttpSliceHas(HttpSlice s, char *token);
+char *HttpSliceCopy(char *out, size_t size, HttpSlice s);
+
+void HttpInitBuilder(HttpBuilder *b);
+void HttpAdd(HttpBuilder *b, char *p, size_t len);
+void HttpAddString(HttpBuilder *b, char *s);
+void HttpAddSlice(HttpBuilder *b, HttpSlice s);
+
+#endif /* __HTTP_H__ */
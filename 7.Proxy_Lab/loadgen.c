@@ -0,0 +1,574 @@
+/*
+ * loadgen.c - Load generator and latency benchmark for the proxy. Each of
+ *     -c client threads sends requests through the proxy, on one kept-alive
+ *     connection with -k or a new one per request, and times each from
+ *     send, or connect, to the last byte of the response. The objects it
+ *     asks for mix sizes as -m says, and -r of the requests go to a small
+ *     set of hot objects the proxy can cache, the rest to objects never
+ *     asked for before. With -S it also runs a stub origin that serves
+ *     such objects, alone if no proxy is given. At the end it reports
+ *     throughput and the latency percentiles.
+ */
+#define _GNU_SOURCE             /* strcasestr() */
+#include <netinet/tcp.h>
+
+#include "csapp.h"
+#include "histogram.h"
+
+#define DEFAULT_CONNS 16
+#define DEFAULT_REQUESTS 10000
+#define DEFAULT_MIX "4k"
+#define DEFAULT_HIT_RATIO 0.9
+
+#define HOT_OBJECTS 64          /* Objects the hit ratio is spread over */
+#define MAX_MIX 16
+#define MAX_PATHS 64
+#define MAX_OBJECT (64 << 20)   /* Largest object the stub serves */
+#define IO_BUFSIZE 65536
+
+
+
+typedef struct
+{
+    long size;
+    int weight;                 /* Percent of the objects of this size */
+} MixEntry;
+
+
+typedef struct
+{
+    int id;
+    pthread_t tid;
+    unsigned int seed;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long bytes;
+    unsigned long connects;
+    Histogram hist;
+} Client;
+
+
+void *RunClient(void *vargp);
+int NextRequest();
+void FormatRequest(Client *client, char *buf);
+long SizeOf(unsigned long key);
+int ReadResponse(rio_t *rio, char *buf, long *bytes, int *close_after);
+void *StubOrigin(void *vargp);
+void *StubConn(void *vargp);
+int ParseMix(char *spec);
+long ParseSize(char *s);
+void SplitHostPort(char *s, char **host, char **port);
+long NowUs();
+void Usage(char *prog);
+
+
+/* Settings, fixed before the clients start */
+char *proxy_host, *proxy_port;
+char *origin_host, *origin_port;
+int keep_alive;
+double hit_ratio = DEFAULT_HIT_RATIO;
+MixEntry mix[MAX_MIX];
+int mix_cnt;
+char *paths[MAX_PATHS];
+int path_cnt;
+
+/* Requests left, or -1 to run until deadline */
+long requests_left = DEFAULT_REQUESTS;
+long deadline;
+unsigned long next_cold = HOT_OBJECTS;  /* Key of the next cold object */
+
+char stub_body[IO_BUFSIZE];
+
+
+int main(int argc, char **argv)
+{
+    char *stub_port = NULL;
+    int conns = DEFAULT_CONNS;
+    int opt;
+
+    ParseMix(DEFAULT_MIX);
+    while ((opt = getopt(argc, argv, "S:p:o:c:n:d:km:r:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'S':
+            stub_port = optarg;
+            break;
+        case 'p':
+            SplitHostPort(optarg, &proxy_host, &proxy_port);
+            break;
+        case 'o':
+            SplitHostPort(optarg, &origin_host, &origin_port);
+            break;
+        case 'c':
+            if ((conns = atoi(optarg)) <= 0)
+                Usage(argv[0]);
+            break;
+        case 'n':
+            if ((requests_left = atol(optarg)) <= 0)
+                Usage(argv[0]);
+            break;
+        case 'd':
+            requests_left = -1;
+            deadline = atol(optarg) * 1000000;
+            if (deadline <= 0)
+                Usage(argv[0]);
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'm':
+            if (ParseMix(optarg) < 0)
+                Usage(argv[0]);
+            break;
+        case 'r':
+            hit_ratio = atof(optarg);
+            if (hit_ratio < 0 || hit_ratio > 1)
+                Usage(argv[0]);
+            break;
+        case 'f':
+            if (path_cnt == MAX_PATHS)
+                Usage(argv[0]);
+            paths[path_cnt++] = optarg;
+            break;
+        default:
+            Usage(argv[0]);
+        }
+    }
+    if (optind != argc || (proxy_host == NULL && stub_port == NULL))
+        Usage(argv[0]);
+
+    Signal(SIGPIPE, SIG_IGN);
+    if (stub_port != NULL)
+    {
+        pthread_t tid;
+        int listenfd = Open_listenfd(stub_port);
+
+        memset(stub_body, 'x', IO_BUFSIZE);
+        Pthread_create(&tid, NULL, StubOrigin, (void *) (long) listenfd);
+        if (proxy_host == NULL)
+        {
+            printf("stub origin serving on port %s\n", stub_port);
+            Pthread_join(tid, NULL);
+        }
+        if (origin_host == NULL)
+        {
+            origin_host = "localhost";
+            origin_port = stub_port;
+        }
+    }
+    if (origin_host == NULL)
+        Usage(argv[0]);
+
+    /* Run the clients */
+    Client *clients = Calloc(conns, sizeof(Client));
+    long start = NowUs();
+    if (requests_left < 0)
+        deadline += start;
+    for (int i = 0; i < conns; i++)
+    {
+        clients[i].id = i;
+        clients[i].seed = i + 1;
+        Pthread_create(&clients[i].tid, NULL, RunClient, &clients[i]);
+    }
+
+    Histogram *hist = Calloc(1, sizeof(Histogram));
+    unsigned long requests = 0, errors = 0, bytes = 0, connects = 0;
+    for (int i = 0; i < conns; i++)
+    {
+        Pthread_join(clients[i].tid, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        connects += clients[i].connects;
+        MergeHistogram(hist, &clients[i].hist);
+    }
+    double secs = (NowUs() - start) / 1e6;
+
+    printf("%lu requests, %lu errors, %lu connections in %.2fs\n",
+           requests, errors, connects, secs);
+    printf("throughput: %.1f requests/s, %.2f MB/s\n",
+           requests / secs, bytes / secs / (1 << 20));
+    printf("latency us: p50 %ld  p90 %ld  p99 %ld  p999 %ld  max %ld\n",
+           HistogramPercentile(hist, 0.5), HistogramPercentile(hist, 0.9),
+           HistogramPercentile(hist, 0.99), HistogramPercentile(hist, 0.999), hist->max);
+
+    /* A coarse histogram, one line per power of 2 that has any counts */
+    for (int e = 0; e * HIST_SUB < HIST_BUCKETS; e++)
+    {
+        unsigned long cnt = 0;
+        for (int i = e * HIST_SUB; i < (e + 1) * HIST_SUB; i++)
+            cnt += hist->counts[i];
+        if (cnt == 0)
+            continue;
+        int bar = cnt * 50 / hist->total;
+        printf("  < %8ld us %8lu %5.1f%% ", HistogramBucketValue((e + 1) * HIST_SUB),
+               cnt, cnt * 100.0 / hist->total);
+        for (int i = 0; i < bar; i++)
+            putchar('#');
+        putchar('\n');
+    }
+    return errors > 0;
+}
+
+
+/*
+ * RunClient - Send requests until there are none left, reconnecting
+ *     whenever the connection was not kept alive or failed.
+ */
+void *RunClient(void *vargp)
+{
+    Client *client = vargp;
+    char *buf = Malloc(IO_BUFSIZE);
+    int fd = -1;
+    rio_t rio;
+
+    while (NextRequest())
+    {
+        long start = NowUs();
+        int close_after = !keep_alive;
+        long bytes;
+
+        if (fd < 0)
+        {
+            if ((fd = open_clientfd(proxy_host, proxy_port)) < 0)
+            {
+                client->errors++;
+                continue;
+            }
+            client->connects++;
+            rio_readinitb(&rio, fd);
+        }
+
+        FormatRequest(client, buf);
+        if (rio_writen(fd, buf, strlen(buf)) < 0
+            || ReadResponse(&rio, buf, &bytes, &close_after) < 0)
+        {
+            client->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+
+        RecordHistogram(&client->hist, NowUs() - start);
+        client->requests++;
+        client->bytes += bytes;
+        if (close_after)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    Free(buf);
+    return NULL;
+}
+
+
+/* NextRequest - Claim the next request, returns 0 once the run is over */
+int NextRequest()
+{
+    if (requests_left < 0)
+        return NowUs() < deadline;
+    return __atomic_sub_fetch(&requests_left, 1, __ATOMIC_RELAXED) >= 0;
+}
+
+
+/*
+ * FormatRequest - Write the next request of client into buf. With -f the
+ *     paths are taken in turn, otherwise it is a hot object with
+ *     probability hit_ratio, else a cold one.
+ */
+void FormatRequest(Client *client, char *buf)
+{
+    char path[MAXLINE];
+
+    if (path_cnt > 0)
+    {
+        strcpy(path, paths[client->requests % path_cnt]);
+    }
+    else
+    {
+        unsigned long key;
+        if (rand_r(&client->seed) < hit_ratio * ((double) RAND_MAX + 1))
+            key = rand_r(&client->seed) % HOT_OBJECTS;
+        else
+            key = __atomic_fetch_add(&next_cold, 1, __ATOMIC_RELAXED);
+        sprintf(path, "/obj/%ld/%lu", SizeOf(key), key);
+    }
+
+    sprintf(buf, "GET http://%s:%s%s HTTP/%s\r\nHost: %s:%s\r\n%s\r\n",
+            origin_host, origin_port, path, keep_alive ? "1.1" : "1.0",
+            origin_host, origin_port,
+            keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+}
+
+
+/* SizeOf - The size of object key, so that the mix holds over all keys */
+long SizeOf(unsigned long key)
+{
+    int pick = (key * 2654435761UL >> 7) % 100;
+
+    for (int i = 0; i < mix_cnt; i++)
+    {
+        if ((pick -= mix[i].weight) < 0)
+            return mix[i].size;
+    }
+    return mix[mix_cnt - 1].size;
+}
+
+
+/*
+ * ReadResponse - Read a whole response from rio, using buf as scratch,
+ *     and set *bytes to its body length. *close_after is set if the
+ *     connection cannot carry another request. Returns -1 on an error or
+ *     a status other than 200.
+ */
+int ReadResponse(rio_t *rio, char *buf, long *bytes, int *close_after)
+{
+    long length = -1;
+    int status;
+    ssize_t n;
+
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+        return -1;
+    if (sscanf(buf, "HTTP/%*s %d", &status) != 1)
+        return -1;
+
+    while (1)
+    {
+        if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+            return -1;
+        if (!strcmp(buf, "\r\n"))
+            break;
+        if (!strncasecmp(buf, "Content-Length:", 15))
+            length = atol(buf + 15);
+        else if (!strncasecmp(buf, "Connection:", 11) && strcasestr(buf + 11, "close"))
+            *close_after = 1;
+    }
+
+    /* Without a length the body ends with the connection */
+    *bytes = 0;
+    if (length < 0)
+        *close_after = 1;
+    while (length < 0 || *bytes < length)
+    {
+        size_t want = IO_BUFSIZE;
+        if (length >= 0 && length - *bytes < want)
+            want = length - *bytes;
+        if ((n = rio_readnb(rio, buf, want)) < 0)
+            return -1;
+        if (n == 0)
+            break;
+        *bytes += n;
+    }
+
+    if (length >= 0 && *bytes < length)
+        return -1;
+    return status == 200 ? 0 : -1;
+}
+
+
+/***************
+ * Stub origin *
+ ***************/
+
+void *StubOrigin(void *vargp)
+{
+    int listenfd = (long) vargp;
+    int one = 1;
+    pthread_t tid;
+
+    while (1)
+    {
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd < 0)
+            continue;
+
+        /* The head and body go out in separate writes */
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Pthread_create(&tid, NULL, StubConn, (void *) (long) connfd);
+    }
+    return NULL;
+}
+
+
+/*
+ * StubConn - Serve /obj/<size>/<key> as size bytes, on one connection
+ *     for as long as the client keeps it alive, or the single byte range
+ *     of it asked for, so the proxy may cache it in chunks. Any other path
+ *     is a 404.
+ */
+void *StubConn(void *vargp)
+{
+    int connfd = (long) vargp;
+    char buf[MAXLINE], method[MAXLINE], path[MAXLINE], version[MAXLINE];
+    rio_t rio;
+
+    Pthread_detach(pthread_self());
+    rio_readinitb(&rio, connfd);
+    while (rio_readlineb(&rio, buf, MAXLINE) > 0)
+    {
+        int persist = 0;
+        long size, first = -1, last = -1;
+
+        if (sscanf(buf, "%s %s %s", method, path, version) != 3)
+            break;
+        persist = !strcasecmp(version, "HTTP/1.1");
+        while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+        {
+            if (!strncasecmp(buf, "Connection:", 11))
+                persist = strcasestr(buf + 11, "keep-alive") != NULL;
+            else if (!strncasecmp(buf, "Range:", 6))
+                sscanf(buf + 6, " bytes=%ld-%ld", &first, &last);
+        }
+
+        if (sscanf(path, "/obj/%ld/", &size) != 1 || size < 0 || size > MAX_OBJECT)
+        {
+            sprintf(buf, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n",
+                    persist ? "" : "Connection: close\r\n");
+            if (rio_writen(connfd, buf, strlen(buf)) < 0)
+                break;
+            if (!persist)
+                break;
+            continue;
+        }
+
+        long length = size;
+        if (first >= 0 && first < size)
+        {
+            if (last < first || last >= size)
+                last = size - 1;
+            length = last - first + 1;
+            sprintf(buf, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %ld-%ld/%ld\r\n",
+                    first, last, size);
+        }
+        else
+        {
+            sprintf(buf, "HTTP/1.1 200 OK\r\n");
+        }
+        sprintf(buf + strlen(buf), "Content-Type: application/octet-stream\r\n"
+                "Accept-Ranges: bytes\r\nContent-Length: %ld\r\n%s\r\n", length,
+                persist ? "" : "Connection: close\r\n");
+        if (rio_writen(connfd, buf, strlen(buf)) < 0)
+            break;
+        for (long left = length; left > 0; left -= IO_BUFSIZE)
+        {
+            if (rio_writen(connfd, stub_body, left < IO_BUFSIZE ? left : IO_BUFSIZE) < 0)
+                break;
+        }
+        if (!persist)
+            break;
+    }
+    close(connfd);
+    return NULL;
+}
+
+
+/*******************************
+ * Helper function for options *
+ *******************************/
+
+/*
+ * ParseMix - Set the object size mix from spec, size[:weight],... where
+ *     sizes take a k or m suffix and weights are percents, defaulting to
+ *     an equal share of what is left. Returns -1 if spec is malformed.
+ */
+int ParseMix(char *spec)
+{
+    char copy[MAXLINE];
+    int total = 0, unweighted = 0;
+
+    strncpy(copy, spec, MAXLINE - 1);
+    copy[MAXLINE - 1] = '\0';
+    mix_cnt = 0;
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        char *colon = strchr(item, ':');
+        if (mix_cnt == MAX_MIX)
+            return -1;
+        if (colon != NULL)
+            *colon = '\0';
+        if ((mix[mix_cnt].size = ParseSize(item)) < 0)
+            return -1;
+        mix[mix_cnt].weight = colon != NULL ? atoi(colon + 1) : -1;
+        if (mix[mix_cnt].weight < 0)
+            unweighted++;
+        else
+            total += mix[mix_cnt].weight;
+        mix_cnt++;
+    }
+    if (mix_cnt == 0 || total > 100 || (unweighted == 0 && total != 100))
+        return -1;
+
+    for (int i = 0; i < mix_cnt; i++)
+    {
+        if (mix[i].weight < 0)
+            mix[i].weight = (100 - total) / unweighted;
+    }
+    return 0;
+}
+
+
+/* ParseSize - Parse a byte count like 512, 16k or 1m, -1 if malformed */
+long ParseSize(char *s)
+{
+    char *end;
+    long size = strtol(s, &end, 10);
+
+    if (end == s || size < 0)
+        return -1;
+    if (*end == 'k' || *end == 'K')
+        size <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+        size <<= 20, end++;
+    return *end == '\0' && size <= MAX_OBJECT ? size : -1;
+}
+
+
+void SplitHostPort(char *s, char **host, char **port)
+{
+    char *colon = strrchr(s, ':');
+
+    if (colon == NULL)
+    {
+        *host = "localhost";
+        *port = s;
+        return;
+    }
+    *colon = '\0';
+    *host = s;
+    *port = colon + 1;
+}
+
+
+long NowUs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+void Usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-S port] [-p proxy] [-o origin] [-c conns] "
+            "[-n requests | -d seconds] [-k] [-m mix] [-r ratio] [-f path]...\n", prog);
+    fprintf(stderr, "   -S port     run a stub origin on port, and only that without -p\n");
+    fprintf(stderr, "   -p proxy    [host:]port of the proxy to load\n");
+    fprintf(stderr, "   -o origin   [host:]port of the origin, default the stub\n");
+    fprintf(stderr, "   -c conns    concurrent clients (default %d)\n", DEFAULT_CONNS);
+    fprintf(stderr, "   -n requests requests to send in all (default %d)\n", DEFAULT_REQUESTS);
+    fprintf(stderr, "   -d seconds  send requests for this long instead\n");
+    fprintf(stderr, "   -k          keep connections alive\n");
+    fprintf(stderr, "   -m mix      object sizes, size[:percent],... (default %s)\n",
+            DEFAULT_MIX);
+    fprintf(stderr, "   -r ratio    share of requests for %d hot objects (default %.1f)\n",
+            HOT_OBJECTS, DEFAULT_HIT_RATIO);
+    fprintf(stderr, "   -f path     ask for path instead, repeatable, as for tiny;\n"
+            "               -m and -r do not apply\n");
+    exit(1);
+}
@@ -0,0 +1,194 @@
+/*
+ * log.c - Leveled logging off the request path. A thread logs by
+ *     formatting a record into its own ring, and a drainer thread writes
+ *     the records of all rings to stdout in batches, so logging takes no
+ *     lock and makes no system call in the thread that logs.
+ */
+#include "log.h"
+
+
+static LogRing *NewRing();
+static void DropRing(void *ring);
+static void *Drainer(void *vargp);
+static size_t FormatRecord(char *out, LogRecord *rec);
+static void WriteOut(char *out, size_t n);
+
+
+int log_level = LOG_INFO;
+
+static char *level_names[] = { "debug", "info", "warn", "error" };
+
+/* Rings of all threads that have logged, newest first, never unlinked */
+static LogRing *rings;
+static __thread LogRing *my_ring;
+static pthread_key_t ring_key;      /* Gives the ring back at thread exit */
+
+
+void InitLog(int level)
+{
+    pthread_t tid;
+
+    log_level = level;
+    pthread_key_create(&ring_key, DropRing);
+    Pthread_create(&tid, NULL, Drainer, NULL);
+}
+
+
+/*
+ * FindLogLevel - Return the level named name, or -1 if there is none.
+ */
+int FindLogLevel(char *name)
+{
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++)
+    {
+        if (!strcasecmp(name, level_names[i]))
+            return i;
+    }
+    return -1;
+}
+
+
+/*
+ * LogWrite - Format a record into the calling thread's ring. Use LOG,
+ *     which skips the call below log_level. A trailing newline is
+ *     dropped, the drainer ends every record with one.
+ */
+void LogWrite(int level, char *fmt, ...)
+{
+    LogRing *ring = my_ring != NULL ? my_ring : NewRing();
+    unsigned long head = ring->head;
+    va_list ap;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+    rec->level = level;
+    clock_gettime(CLOCK_REALTIME_COARSE, &rec->time);
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->text, LOG_TEXT_SIZE, fmt, ap);
+    va_end(ap);
+    if (n > LOG_TEXT_SIZE - 1)
+        n = LOG_TEXT_SIZE - 1;
+    if (n > 0 && rec->text[n - 1] == '\n')
+        rec->text[n - 1] = '\0';
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * LogAccess - Log the access record of a request at LOG_INFO: what was
+ *     asked for, whether the cache had it, whether it was answered and
+ *     how long that took, in us.
+ */
+void LogAccess(char *method, char *uri, char *cache, int ok, long us)
+{
+    LOG(LOG_INFO, "access method=%s uri=%s cache=%s result=%s us=%ld",
+        method, uri, cache, ok ? "ok" : "failed", us);
+}
+
+
+/*
+ * NewRing - Give the calling thread a ring, one an exited thread left if
+ *     there is any, else a new one handed to the drainer.
+ */
+static LogRing *NewRing()
+{
+    LogRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    int free = 0;
+
+    for (; ring != NULL; ring = ring->next)
+    {
+        if (__atomic_compare_exchange_n(&ring->in_use, &free, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        free = 0;
+    }
+
+    if (ring == NULL)
+    {
+        ring = Calloc(1, sizeof(LogRing));
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+
+/* DropRing - Leave the ring of an exiting thread to the next one */
+static void DropRing(void *ring)
+{
+    __atomic_store_n(&((LogRing *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Drainer - Every LOG_DRAIN_INTERVAL, move the records of every ring to
+ *     stdout. Records of one thread keep their order, records of
+ *     different threads are only ordered by their timestamps.
+ */
+static void *Drainer(void *vargp)
+{
+    static char out[LOG_OUT_SIZE];
+    size_t n = 0;
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        LogRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+        for (; ring != NULL; ring = ring->next)
+        {
+            unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            unsigned long tail = ring->tail;
+
+            for (; tail != head; tail++)
+            {
+                if (LOG_OUT_SIZE - n < LOG_TEXT_SIZE + 64)
+                {
+                    WriteOut(out, n);
+                    n = 0;
+                }
+                n += FormatRecord(out + n, &ring->records[tail & (LOG_RING_SIZE - 1)]);
+            }
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+            unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+            if (dropped > 0 && LOG_OUT_SIZE - n >= 64)
+                n += sprintf(out + n, "log: %lu records dropped\n", dropped);
+        }
+        WriteOut(out, n);
+        n = 0;
+        usleep(LOG_DRAIN_INTERVAL);
+    }
+    return NULL;
+}
+
+
+/*
+ * FormatRecord - Write rec as a line into out, returning its length.
+ */
+static size_t FormatRecord(char *out, LogRecord *rec)
+{
+    struct tm tm;
+
+    localtime_r(&rec->time.tv_sec, &tm);
+    size_t n = strftime(out, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    return n + sprintf(out + n, ".%03ld %-5s %s\n", rec->time.tv_nsec / 1000000,
+                       level_names[rec->level], rec->text);
+}
+
+
+static void WriteOut(char *out, size_t n)
+{
+    if (n > 0)
+        rio_writen(STDOUT_FILENO, out, n);
+}
@@ -0,0 +1,67 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "csapp.h"
+
+/* Levels, a record is kept if its level is at least log_level */
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+/* Records each thread may have waiting for the drainer, a power of 2 */
+#define LOG_RING_SIZE 256
+#define LOG_TEXT_SIZE 240
+
+/* Microseconds the drainer sleeps between passes over the rings */
+#define LOG_DRAIN_INTERVAL 50000
+
+/* Bytes the drainer formats before writing them out at once */
+#define LOG_OUT_SIZE 65536
+
+
+typedef struct
+{
+    int level;
+    struct timespec time;
+    char text[LOG_TEXT_SIZE];
+} LogRecord;
+
+
+/*
+ * The records of one thread, which alone writes head, on its way to the
+ * drainer, which alone writes tail. A full ring drops the record and
+ * counts it rather than block the thread that logs. When the thread
+ * exits, the ring is left to the next thread that starts logging.
+ */
+typedef struct LogRing
+{
+    LogRecord records[LOG_RING_SIZE];
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    unsigned long dropped;
+    int in_use;                     /* Owned by a live thread */
+    struct LogRing *next;           /* Next ring the drainer visits */
+} LogRing;
+
+
+/*
+ * LOG - Log a printf style record at level. Below log_level the arguments
+ *     are not even evaluated, so debug logging on a hot path costs a load
+ *     and a branch.
+ */
+#define LOG(level, ...)                                 \
+    do                                                  \
+    {                                                   \
+        if ((level) >= log_level)                       \
+            LogWrite((level), __VA_ARGS__);             \
+    } while (0)
+
+extern int log_level;
+
+void InitLog(int level);
+int FindLogLevel(char *name);
+void LogWrite(int level, char *fmt, ...);
+void LogAccess(char *method, char *uri, char *cache, int ok, long us);
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,403 @@
+/*
+ * origin.c - Pool of persistent upstream connections. A worker takes an
+ *     idle connection to the origin it needs, or opens one, and hands it
+ *     back once a response has been read in full with its framing intact,
+ *     so misses to a hot origin skip getaddrinfo and the TCP handshake.
+ *     Each origin has ORIGIN_MAX_INFLIGHT connections in use at most, a
+ *     request past them waits a while for one, and connects and reads on
+ *     them are bounded in time, so a slow origin ties up a few workers for
+ *     a while rather than the whole pool.
+ */
+#include <poll.h>
+
+#include "dns.h"
+#include "hash.h"
+#include "log.h"
+#include "origin.h"
+
+
+static Origin *TakeSlot(OriginBucket *bucket, char *key, struct timespec *deadline,
+                        int *rc);
+static void FreeSlot(OriginBucket *bucket, char *key);
+static int OpenOrigin(char *host, char *port, long budget);
+static int ConnectWithin(int fd, struct addrinfo *addr, long *budget);
+static Origin *FindOrigin(OriginBucket *bucket, char *key, int create);
+static void FreeOrigin(OriginBucket *bucket, Origin *origin);
+static void CloseStale(Origin *origin, time_t now);
+static int IsAlive(int fd);
+
+
+static OriginBucket buckets[ORIGIN_BUCKETS];
+static pthread_once_t buckets_once = PTHREAD_ONCE_INIT;
+
+
+static void InitBuckets(void)
+{
+    for (int i = 0; i < ORIGIN_BUCKETS; i++)
+    {
+        pthread_mutex_init(&buckets[i].mutex, NULL);
+        pthread_cond_init(&buckets[i].slot_freed, NULL);
+        buckets[i].origins = NULL;
+    }
+}
+
+
+/*
+ * AcquireOrigin - Return a connection to host:port, idle in the pool or
+ *     newly opened, and set *reused to tell which. It takes one of the
+ *     origin's ORIGIN_MAX_INFLIGHT slots until handed back with
+ *     ReleaseOrigin or DropOrigin, waiting for one if all are taken and
+ *     wait is set. Waiting and connecting share ORIGIN_CONNECT_TIMEOUT.
+ *     Idle connections past ORIGIN_IDLE_TIMEOUT or closed by the origin
+ *     are dropped on the way. Returns ORIGIN_BUSY if no slot was free and
+ *     it could not wait, ORIGIN_TIMEOUT if none came free or the connect
+ *     took too long, ORIGIN_UNREACHABLE if it failed.
+ */
+int AcquireOrigin(char *host, char *port, int wait, int *reused)
+{
+    char key[MAXLINE];
+    time_t now = time(NULL);
+    struct timespec deadline, after;
+    int fd = -1, rc;
+
+    pthread_once(&buckets_once, InitBuckets);
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    OriginBucket *bucket = &buckets[HashString(key) & (ORIGIN_BUCKETS - 1)];
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ORIGIN_CONNECT_TIMEOUT / 1000;
+    deadline.tv_nsec += (ORIGIN_CONNECT_TIMEOUT % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&bucket->mutex);
+    Origin *origin = TakeSlot(bucket, key, wait ? &deadline : NULL, &rc);
+    if (origin == NULL)
+    {
+        pthread_mutex_unlock(&bucket->mutex);
+        return rc;
+    }
+    while (origin->idle_cnt > 0)
+    {
+        int i = --origin->idle_cnt;
+        if (now - origin->idle_since[i] <= ORIGIN_IDLE_TIMEOUT && IsAlive(origin->idle_fds[i]))
+        {
+            fd = origin->idle_fds[i];
+            break;
+        }
+        close(origin->idle_fds[i]);
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+
+    *reused = (fd >= 0);
+    if (fd >= 0)
+        return fd;
+
+    clock_gettime(CLOCK_REALTIME, &after);
+    long budget = (deadline.tv_sec - after.tv_sec) * 1000
+                + (deadline.tv_nsec - after.tv_nsec) / 1000000;
+    if ((fd = OpenOrigin(host, port, budget)) < 0)
+        FreeSlot(bucket, key);
+    return fd;
+}
+
+
+/*
+ * ReleaseOrigin - Keep fd idle for the next request to host:port, and
+ *     give back its slot. The caller must have read the last response on
+ *     it in full. Closes fd if the origin already has ORIGIN_MAX_IDLE
+ *     idle connections.
+ */
+void ReleaseOrigin(char *host, char *port, int fd)
+{
+    char key[MAXLINE];
+
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    OriginBucket *bucket = &buckets[HashString(key) & (ORIGIN_BUCKETS - 1)];
+
+    pthread_mutex_lock(&bucket->mutex);
+    Origin *origin = FindOrigin(bucket, key, 1);
+    if (origin->idle_cnt < ORIGIN_MAX_IDLE)
+    {
+        origin->idle_fds[origin->idle_cnt] = fd;
+        origin->idle_since[origin->idle_cnt] = time(NULL);
+        origin->idle_cnt++;
+        fd = -1;
+    }
+    origin->in_flight--;
+    if (origin->waiting > 0)
+        pthread_cond_broadcast(&bucket->slot_freed);
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (fd >= 0)
+        close(fd);
+}
+
+
+/* DropOrigin - Close fd, a connection to host:port not fit for reuse */
+void DropOrigin(char *host, char *port, int fd)
+{
+    char key[MAXLINE];
+
+    close(fd);
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    FreeSlot(&buckets[HashString(key) & (ORIGIN_BUCKETS - 1)], key);
+}
+
+
+/*
+ * TakeOriginSlot - Take one of the ORIGIN_MAX_INFLIGHT slots of host:port
+ *     for a connection the caller opens and closes itself, as the event
+ *     loops do. Returns 0 if all of them are taken, as it does not wait.
+ *     Give it back with FreeOriginSlot.
+ */
+int TakeOriginSlot(char *host, char *port)
+{
+    char key[MAXLINE];
+
+    pthread_once(&buckets_once, InitBuckets);
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    OriginBucket *bucket = &buckets[HashString(key) & (ORIGIN_BUCKETS - 1)];
+
+    pthread_mutex_lock(&bucket->mutex);
+    int rc, taken = TakeSlot(bucket, key, NULL, &rc) != NULL;
+    pthread_mutex_unlock(&bucket->mutex);
+    return taken;
+}
+
+
+void FreeOriginSlot(char *host, char *port)
+{
+    char key[MAXLINE];
+
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    FreeSlot(&buckets[HashString(key) & (ORIGIN_BUCKETS - 1)], key);
+}
+
+
+/*
+ * SweepOrigins - Close idle connections past ORIGIN_IDLE_TIMEOUT to every
+ *     origin, not only those asked for again, and free the origins left
+ *     with no connection idle or in use. Called about once a second.
+ */
+void SweepOrigins()
+{
+    time_t now = time(NULL);
+
+    pthread_once(&buckets_once, InitBuckets);
+    for (int i = 0; i < ORIGIN_BUCKETS; i++)
+    {
+        OriginBucket *bucket = &buckets[i];
+
+        pthread_mutex_lock(&bucket->mutex);
+        Origin *origin = bucket->origins;
+        while (origin)
+        {
+            Origin *next = origin->next;
+            CloseStale(origin, now);
+            if (origin->idle_cnt == 0 && origin->in_flight == 0 && origin->waiting == 0)
+                FreeOrigin(bucket, origin);
+            origin = next;
+        }
+        pthread_mutex_unlock(&bucket->mutex);
+    }
+}
+
+
+/*
+ * TakeSlot - Take a slot of the origin key and return the origin. With
+ *     none free, wait for one until deadline, unless deadline is NULL or
+ *     ORIGIN_MAX_WAITERS wait already, and return NULL with *rc set to
+ *     ORIGIN_BUSY or ORIGIN_TIMEOUT if none came. Caller holds the mutex
+ *     of bucket.
+ */
+static Origin *TakeSlot(OriginBucket *bucket, char *key, struct timespec *deadline,
+                        int *rc)
+{
+    Origin *origin = FindOrigin(bucket, key, 1);
+
+    if (origin->in_flight >= ORIGIN_MAX_INFLIGHT)
+    {
+        if (deadline == NULL || origin->waiting >= ORIGIN_MAX_WAITERS)
+        {
+            LOG(LOG_WARN, "All %d connections to %s in use", ORIGIN_MAX_INFLIGHT, key);
+            *rc = ORIGIN_BUSY;
+            return NULL;
+        }
+
+        origin->waiting++;
+        while (origin->in_flight >= ORIGIN_MAX_INFLIGHT
+               && pthread_cond_timedwait(&bucket->slot_freed, &bucket->mutex, deadline) != ETIMEDOUT)
+            ;
+        origin->waiting--;
+        if (origin->in_flight >= ORIGIN_MAX_INFLIGHT)
+        {
+            LOG(LOG_WARN, "No free connection to %s in %dms", key, ORIGIN_CONNECT_TIMEOUT);
+            *rc = ORIGIN_TIMEOUT;
+            return NULL;
+        }
+    }
+    origin->in_flight++;
+    return origin;
+}
+
+
+/*
+ * FreeSlot - Give back a slot of the origin key. An origin that failed
+ *     to connect has no idle connection either, so one never reached
+ *     does not keep its record.
+ */
+static void FreeSlot(OriginBucket *bucket, char *key)
+{
+    pthread_mutex_lock(&bucket->mutex);
+    Origin *origin = FindOrigin(bucket, key, 1);
+    if (--origin->in_flight == 0 && origin->idle_cnt == 0 && origin->waiting == 0)
+        FreeOrigin(bucket, origin);
+    else if (origin->waiting > 0)
+        pthread_cond_broadcast(&bucket->slot_freed);
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+
+/*
+ * OpenOrigin - open_clientfd with the addresses taken from the lookup
+ *     cache, all of them trying within budget ms. Reads on the
+ *     connection time out after ORIGIN_READ_TIMEOUT, as do writes.
+ *     Returns ORIGIN_UNREACHABLE if the lookup fails or no address
+ *     accepts, ORIGIN_TIMEOUT if the time ran out first.
+ */
+static int OpenOrigin(char *host, char *port, long budget)
+{
+    DnsAddrs *addrs = ResolveHost(host, port);
+    struct timeval timeout = { ORIGIN_READ_TIMEOUT, 0 };
+    int fd = -1, rc = budget > 0 ? ORIGIN_UNREACHABLE : ORIGIN_TIMEOUT;
+
+    if (addrs == NULL)
+        return ORIGIN_UNREACHABLE;
+
+    for (struct addrinfo *p = addrs->list; p && budget > 0; p = p->ai_next)
+    {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if ((rc = ConnectWithin(fd, p, &budget)) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    ReleaseAddrs(addrs);
+
+    if (fd < 0)
+    {
+        LOG(LOG_WARN, "Cannot connect to %s:%s%s", host, port,
+            rc == ORIGIN_TIMEOUT ? " in time" : "");
+        return rc;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+
+/*
+ * ConnectWithin - Connect fd to addr without blocking longer than
+ *     *budget ms, taking the time spent off *budget. fd is left blocking.
+ *     Returns 0 once connected, ORIGIN_TIMEOUT or ORIGIN_UNREACHABLE.
+ */
+static int ConnectWithin(int fd, struct addrinfo *addr, long *budget)
+{
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    struct timespec start, end;
+    int flags = fcntl(fd, F_GETFL);
+    int err = 0, n;
+    socklen_t len = sizeof(err);
+
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0)
+    {
+        if (errno != EINPROGRESS)
+            return ORIGIN_UNREACHABLE;
+        while ((n = poll(&pfd, 1, *budget)) < 0 && errno == EINTR)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        *budget -= (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+        if (n == 0)
+            return ORIGIN_TIMEOUT;
+        if (n < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            return ORIGIN_UNREACHABLE;
+    }
+    fcntl(fd, F_SETFL, flags);
+    return 0;
+}
+
+
+/* Caller holds the mutex of bucket */
+static Origin *FindOrigin(OriginBucket *bucket, char *key, int create)
+{
+    Origin *origin;
+
+    for (origin = bucket->origins; origin; origin = origin->next)
+    {
+        if (!strcmp(origin->key, key))
+            return origin;
+    }
+    if (!create)
+        return NULL;
+
+    origin = Calloc(1, sizeof(Origin));
+    origin->key = Malloc(strlen(key) + 1);
+    strcpy(origin->key, key);
+    origin->next = bucket->origins;
+    bucket->origins = origin;
+    return origin;
+}
+
+
+/* Caller holds the mutex of bucket, and origin has no connection left */
+static void FreeOrigin(OriginBucket *bucket, Origin *origin)
+{
+    Origin **prev = &bucket->origins;
+
+    while (*prev != origin)
+        prev = &(*prev)->next;
+    *prev = origin->next;
+    Free(origin->key);
+    Free(origin);
+}
+
+
+/*
+ * CloseStale - Close the idle connections of origin past
+ *     ORIGIN_IDLE_TIMEOUT. Being pushed as they come back, the oldest are
+ *     at the bottom of the stack. Caller holds the mutex of its bucket.
+ */
+static void CloseStale(Origin *origin, time_t now)
+{
+    int stale = 0;
+
+    while (stale < origin->idle_cnt && now - origin->idle_since[stale] > ORIGIN_IDLE_TIMEOUT)
+        close(origin->idle_fds[stale++]);
+    if (stale == 0)
+        return;
+
+    origin->idle_cnt -= stale;
+    memmove(origin->idle_fds, origin->idle_fds + stale, origin->idle_cnt * sizeof(int));
+    memmove(origin->idle_since, origin->idle_since + stale, origin->idle_cnt * sizeof(time_t));
+}
+
+
+/*
+ * IsAlive - Check an idle connection without blocking. An origin that
+ *     closed it reads as EOF, and one that sent unasked bytes cannot be
+ *     trusted with the next response either.
+ */
+static int IsAlive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
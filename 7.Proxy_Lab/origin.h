@@ -0,0 +1,64 @@
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include "csapp.h"
+
+/* Idle connections kept per origin, and for how long, in seconds */
+#define ORIGIN_MAX_IDLE 8
+#define ORIGIN_IDLE_TIMEOUT 30
+
+/* Hash buckets of the origin table, a power of 2 */
+#define ORIGIN_BUCKETS 64
+
+/*
+ * Connections in use per origin at once, and requests that may wait for
+ * one of them to come back, within ORIGIN_CONNECT_TIMEOUT. Together well
+ * under MAX_WORKERS, so that one slow origin cannot hold every worker; a
+ * request past both is turned away at once.
+ */
+#define ORIGIN_MAX_INFLIGHT 16
+#define ORIGIN_MAX_WAITERS 16
+
+/* ms a connect may take, over all addresses, and seconds a read may stall */
+#define ORIGIN_CONNECT_TIMEOUT 3000
+#define ORIGIN_READ_TIMEOUT 10
+
+/* Results of AcquireOrigin, besides a connection */
+#define ORIGIN_UNREACHABLE -1
+#define ORIGIN_TIMEOUT -2       /* No free slot, or no connection in time */
+#define ORIGIN_BUSY -3          /* No free slot, and no waiting for one */
+
+
+/*
+ * The idle upstream connections to one host:port, kept as a stack so the
+ * most recently used and so warmest one is reused first, and the count
+ * of those in use, held to ORIGIN_MAX_INFLIGHT.
+ */
+typedef struct Origin
+{
+    char *key;
+    int idle_fds[ORIGIN_MAX_IDLE];
+    time_t idle_since[ORIGIN_MAX_IDLE];
+    int idle_cnt;
+    int in_flight;
+    int waiting;                    /* Requests waiting for a slot */
+    struct Origin *next;            /* Next origin in the same bucket */
+} Origin;
+
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t slot_freed;      /* Broadcast when in_flight drops */
+    Origin *origins;
+} OriginBucket;
+
+
+int AcquireOrigin(char *host, char *port, int wait, int *reused);
+void ReleaseOrigin(char *host, char *port, int fd);
+void DropOrigin(char *host, char *port, int fd);
+int TakeOriginSlot(char *host, char *port);
+void FreeOriginSlot(char *host, char *port);
+void SweepOrigins(void);
+
+#endif /* __ORIGIN_H__ */
@@ -0,0 +1,354 @@
+#include "cache.h"
+
+/* Share of a shard's bytes W-TinyLFU keeps in its admission window */
+#define WINDOW_PERCENT 10
+
+/* Oldest entries LFU compares when picking a victim */
+#define LFU_SAMPLES 8
+#define LFU_MAX 255
+
+/* Sketch counters saturate at SKETCH_MAX and are halved every SKETCH_RESET adds */
+#define SKETCH_MAX 15
+#define SKETCH_RESET (10 * SKETCH_WIDTH)
+
+/* Queues of W-TinyLFU, the other policies only use the first one */
+#define WINDOW 0
+#define MAIN 1
+#define CANDIDATE 2
+
+
+static void QueuePush(CacheQueue *queue, CacheEntry *entry);
+static void QueueRemove(CacheQueue *queue, CacheEntry *entry);
+static CacheEntry *QueuePop(CacheQueue *queue);
+static void Promote(CacheShard *shard, CacheEntry *entry);
+static void MarkReferenced(CacheShard *shard, CacheEntry *entry);
+static void PushNew(CacheShard *shard, CacheEntry *entry);
+static void RemoveQueued(CacheShard *shard, CacheEntry *entry);
+
+static CacheEntry *ClockVictim(CacheShard *shard);
+static CacheEntry *LruVictim(CacheShard *shard);
+static void LfuOnHit(CacheShard *shard, CacheEntry *entry);
+static CacheEntry *LfuVictim(CacheShard *shard);
+static CacheEntry *SieveVictim(CacheShard *shard);
+static void TinyLfuInit(CacheShard *shard);
+static void TinyLfuOnAccess(CacheShard *shard, unsigned long hash);
+static void TinyLfuOnHit(CacheShard *shard, CacheEntry *entry);
+static void TinyLfuOnInsert(CacheShard *shard, CacheEntry *entry);
+static CacheEntry *TinyLfuVictim(CacheShard *shard);
+static int SketchEstimate(CacheShard *shard, unsigned long hash);
+
+
+static CachePolicy policies[] = {
+    /* name        Init         OnAccess         OnHit           OnInsert         Victim         Remove */
+    {"clock",      NULL,        NULL,            MarkReferenced, PushNew,         ClockVictim,   RemoveQueued},
+    {"lru",        NULL,        NULL,            Promote,        PushNew,         LruVictim,     RemoveQueued},
+    {"lfu",        NULL,        NULL,            LfuOnHit,       PushNew,         LfuVictim,     RemoveQueued},
+    {"sieve",      NULL,        NULL,            MarkReferenced, PushNew,         SieveVictim,   RemoveQueued},
+    {"wtinylfu",   TinyLfuInit, TinyLfuOnAccess, TinyLfuOnHit,   TinyLfuOnInsert, TinyLfuVictim, RemoveQueued},
+};
+
+
+CachePolicy *FindCachePolicy(char *name)
+{
+    for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    {
+        if (!strcasecmp(name, policies[i].name))
+            return &policies[i];
+    }
+    return NULL;
+}
+
+
+char *CachePolicyNames()
+{
+    return "clock, lru, lfu, sieve, wtinylfu";
+}
+
+
+/*********************************************
+ * Helper function for the queues of a shard *
+ *********************************************/
+
+/* Append entry at the newest end of queue */
+static void QueuePush(CacheQueue *queue, CacheEntry *entry)
+{
+    entry->newer = NULL;
+    entry->older = queue->newest;
+    if (queue->newest)
+        queue->newest->newer = entry;
+    else
+        queue->oldest = entry;
+    queue->newest = entry;
+    queue->size += entry->obj_size;
+}
+
+
+static void QueueRemove(CacheQueue *queue, CacheEntry *entry)
+{
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        queue->oldest = entry->newer;
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        queue->newest = entry->older;
+    entry->older = entry->newer = NULL;
+    queue->size -= entry->obj_size;
+}
+
+
+static CacheEntry *QueuePop(CacheQueue *queue)
+{
+    CacheEntry *entry = queue->oldest;
+    if (entry)
+        QueueRemove(queue, entry);
+    return entry;
+}
+
+
+/*
+ * Promote - Move entry to the newest end of its queue on a hit. Hits run
+ *     concurrently under the read lock, so the move is made under the
+ *     promote_mutex, and skipped rather than waited for when another hit
+ *     holds it: a busy shard keeps a slightly stale order instead of
+ *     serializing its readers.
+ */
+static void Promote(CacheShard *shard, CacheEntry *entry)
+{
+    if (pthread_mutex_trylock(&shard->promote_mutex) != 0)
+        return;
+    QueueRemove(&shard->queues[entry->segment], entry);
+    QueuePush(&shard->queues[entry->segment], entry);
+    pthread_mutex_unlock(&shard->promote_mutex);
+}
+
+
+static void MarkReferenced(CacheShard *shard, CacheEntry *entry)
+{
+    __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+}
+
+
+static void PushNew(CacheShard *shard, CacheEntry *entry)
+{
+    QueuePush(&shard->queues[0], entry);
+}
+
+
+/* Take entry off whichever queue it is on, moving the SIEVE hand past it */
+static void RemoveQueued(CacheShard *shard, CacheEntry *entry)
+{
+    if (shard->hand == entry)
+        shard->hand = entry->newer;
+    QueueRemove(&shard->queues[entry->segment], entry);
+}
+
+
+/****************
+ * CLOCK policy *
+ ****************/
+
+/* Entries hit since the hand last passed them get a second chance */
+static CacheEntry *ClockVictim(CacheShard *shard)
+{
+    CacheEntry *victim;
+
+    while ((victim = QueuePop(&shard->queues[0])) != NULL)
+    {
+        if (!__atomic_exchange_n(&victim->referenced, 0, __ATOMIC_RELAXED))
+            break;
+        QueuePush(&shard->queues[0], victim);
+    }
+    return victim;
+}
+
+
+/**************
+ * LRU policy *
+ **************/
+
+/* Hits move the entry to the newest end, the oldest one is evicted */
+static CacheEntry *LruVictim(CacheShard *shard)
+{
+    return QueuePop(&shard->queues[0]);
+}
+
+
+/**************
+ * LFU policy *
+ **************/
+
+/*
+ * The least hit of the LFU_SAMPLES oldest entries is evicted. The
+ * counts of the others are halved, so objects that were hot once
+ * eventually age out.
+ */
+static void LfuOnHit(CacheShard *shard, CacheEntry *entry)
+{
+    if (__atomic_load_n(&entry->freq, __ATOMIC_RELAXED) < LFU_MAX)
+        __atomic_add_fetch(&entry->freq, 1, __ATOMIC_RELAXED);
+}
+
+
+static CacheEntry *LfuVictim(CacheShard *shard)
+{
+    CacheEntry *victim = shard->queues[0].oldest;
+    CacheEntry *entry = victim;
+
+    for (int i = 0; entry && i < LFU_SAMPLES; i++, entry = entry->newer)
+    {
+        if (entry->freq < victim->freq)
+            victim = entry;
+    }
+    entry = shard->queues[0].oldest;
+    for (int i = 0; entry && i < LFU_SAMPLES; i++, entry = entry->newer)
+        entry->freq >>= 1;
+
+    if (victim)
+        QueueRemove(&shard->queues[0], victim);
+    return victim;
+}
+
+
+/****************
+ * SIEVE policy *
+ ****************/
+
+/*
+ * Entries stay where they were inserted. The hand moves from the
+ * oldest to the newest and evicts the first entry not hit since it
+ * last passed.
+ */
+static CacheEntry *SieveVictim(CacheShard *shard)
+{
+    CacheQueue *queue = &shard->queues[0];
+    CacheEntry *victim = shard->hand ? shard->hand : queue->oldest;
+
+    while (victim && __atomic_exchange_n(&victim->referenced, 0, __ATOMIC_RELAXED))
+        victim = victim->newer ? victim->newer : queue->oldest;
+
+    if (victim)
+    {
+        shard->hand = victim->newer;
+        QueueRemove(queue, victim);
+    }
+    return victim;
+}
+
+
+/********************
+ * W-TinyLFU policy *
+ ********************/
+
+/*
+ * New entries enter a small LRU window. Entries leaving the window
+ * become candidates for the main LRU queue. On eviction a candidate
+ * only gets in if a count-min sketch of all lookups says it is more
+ * popular than the main victim, so a scan of one-hit wonders cannot
+ * flush the hot objects. A hit admits a candidate right away.
+ */
+static void TinyLfuInit(CacheShard *shard)
+{
+    shard->sketch = Calloc(SKETCH_ROWS * SKETCH_WIDTH, 1);
+    shard->sketch_adds = 0;
+}
+
+
+static unsigned long SketchIndex(unsigned long hash, int row)
+{
+    hash *= 0x9E3779B97F4A7C15UL;
+    return row * SKETCH_WIDTH + ((hash >> (16 * row)) & (SKETCH_WIDTH - 1));
+}
+
+
+/* Count a lookup of hash, hit or miss. Runs under the read lock */
+static void TinyLfuOnAccess(CacheShard *shard, unsigned long hash)
+{
+    for (int row = 0; row < SKETCH_ROWS; row++)
+    {
+        unsigned char *counter = &shard->sketch[SketchIndex(hash, row)];
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) < SKETCH_MAX)
+            __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&shard->sketch_adds, 1, __ATOMIC_RELAXED);
+}
+
+
+static int SketchEstimate(CacheShard *shard, unsigned long hash)
+{
+    int min = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_ROWS; row++)
+    {
+        int cnt = shard->sketch[SketchIndex(hash, row)];
+        if (cnt < min)
+            min = cnt;
+    }
+    return min;
+}
+
+
+static void TinyLfuOnHit(CacheShard *shard, CacheEntry *entry)
+{
+    if (pthread_mutex_trylock(&shard->promote_mutex) != 0)
+        return;
+    QueueRemove(&shard->queues[entry->segment], entry);
+    if (entry->segment == CANDIDATE)
+        entry->segment = MAIN;
+    QueuePush(&shard->queues[entry->segment], entry);
+    pthread_mutex_unlock(&shard->promote_mutex);
+}
+
+
+static void TinyLfuOnInsert(CacheShard *shard, CacheEntry *entry)
+{
+    CacheQueue *window = &shard->queues[WINDOW];
+    CacheQueue *main_queue = &shard->queues[MAIN];
+
+    /* Age the sketch, no lookup runs while the write lock is held */
+    if (shard->sketch_adds >= SKETCH_RESET)
+    {
+        for (int i = 0; i < SKETCH_ROWS * SKETCH_WIDTH; i++)
+            shard->sketch[i] >>= 1;
+        shard->sketch_adds = 0;
+    }
+
+    entry->segment = WINDOW;
+    QueuePush(window, entry);
+
+    while (window->oldest != window->newest
+           && window->size * 100 > (window->size + main_queue->size
+                                    + shard->queues[CANDIDATE].size) * WINDOW_PERCENT)
+    {
+        CacheEntry *candidate = QueuePop(window);
+        candidate->segment = CANDIDATE;
+        QueuePush(&shard->queues[CANDIDATE], candidate);
+    }
+}
+
+
+static CacheEntry *TinyLfuVictim(CacheShard *shard)
+{
+    CacheQueue *main_queue = &shard->queues[MAIN];
+    CacheEntry *candidate, *victim;
+
+    while ((candidate = QueuePop(&shard->queues[CANDIDATE])) != NULL)
+    {
+        victim = main_queue->oldest;
+        if (victim != NULL
+            && SketchEstimate(shard, candidate->hash) <= SketchEstimate(shard, victim->hash))
+            return candidate;
+
+        candidate->segment = MAIN;
+        QueuePush(main_queue, candidate);
+        if (victim != NULL)
+        {
+            QueueRemove(main_queue, victim);
+            return victim;
+        }
+    }
+
+    if ((victim = QueuePop(main_queue)) != NULL)
+        return victim;
+    return QueuePop(&shard->queues[WINDOW]);
+}
@@ -1,441 +1,1729 @@
+#define _GNU_SOURCE             /* splice() */
 #include <stdio.h>
+#include <linux/futex.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 #include "csapp.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_CACHE (MAX_CACHE_SIZE / MAX_OBJECT_SIZE)
-#define SBUFSIZE 16
-#define NTHREADS 4
-
-
-typedef struct 
+#include "cache.h"
+#include "chunk.h"
+#include "disk.h"
+#include "dns.h"
+#include "fresh.h"
+#include "gzip.h"
+#include "http.h"
+#include "log.h"
+#include "origin.h"
+#include "proxy.h"
+#include "stats.h"
+
+#define SBUFSIZE 16             /* A power of 2 */
+#define NACCEPTORS 2
+
+/* Bounds of the worker pool */
+#define MIN_WORKERS NTHREADS
+#define MAX_WORKERS 64
+
+/* The pool grows while a queued client has waited this long, in us */
+#define POOL_GROW_WAIT 2000
+#define POOL_TICK 10000         /* How often that is checked, in us */
+
+/* Seconds a worker above MIN_WORKERS idles before it retires */
+#define WORKER_IDLE_TIMEOUT 10
+
+/* Seconds a client may sit idle between requests, or stall within one */
+#define CLIENT_IDLE_TIMEOUT 15
+
+/* ms before clients that found the request queue full are queued again */
+#define IDLE_RETRY_WAIT 10
+
+
+/*
+ * A refresh of a hot stale entry, queued for a worker while the entry is
+ * served as it is. The job holds a reference to stale, and fill is in
+ * flight for its uri.
+ */
+typedef struct
 {
-    char host[MAXLINE];
-    char port[MAXLINE];
-    char path[MAXLINE];
-} URI;
-
+    CacheEntry *stale;
+    CacheEntry *fill;
+    char host[MAXLINE];             /* The Host header of the request */
+    size_t host_len;                /* 0 if it had none */
+} RefreshJob;
+
+
+/*
+ * A bounded lock-free queue of accepted socket descriptors, and of
+ * refresh jobs, after Dmitry Vyukov's MPMC ring. The seq of a cell says
+ * whose turn it is: producers may fill the cell at pos once seq == pos,
+ * consumers may take it once seq == pos + 1. A handoff is a CAS on a
+ * position and a store to a cell. Threads only park, on the items or
+ * slots futex, while the queue is empty or full, and are only woken if
+ * one is parked.
+ */
+typedef struct
+{
+    unsigned long seq;
+    int fd;                     /* -1 for a refresh job */
+    RefreshJob *job;
+    long queued_at;             /* NowUs() when fd was queued */
+} QueueCell;
 
-/* A circular queue to save accepted socket desciptors */
-typedef struct {
-    int *desciptors;
-    int max_size; 
-    int front;
-    int rear;
-    sem_t mutex;
-    sem_t slots;
-    sem_t items;
+typedef struct
+{
+    QueueCell *cells;
+    unsigned long mask;
+    unsigned long enqueue_pos __attribute__((aligned(64)));
+    unsigned long dequeue_pos __attribute__((aligned(64)));
+    int items __attribute__((aligned(64)));     /* Bumped by every insert */
+    int item_waiters;
+    int slots __attribute__((aligned(64)));     /* Bumped by every get */
+    int slot_waiters;
 } RequestQueue;
 
 
+/*
+ * The workers answering queued clients, between MIN_WORKERS and
+ * MAX_WORKERS of them. The pool manager adds workers while queued
+ * clients wait too long, and a worker above the minimum retires once it
+ * idled WORKER_IDLE_TIMEOUT. Waits and service times are moving
+ * averages in us, updated without a lock, so an update may be lost.
+ */
 typedef struct
 {
-    char uri[MAXLINE];
-    char obj[MAX_OBJECT_SIZE];
-    size_t obj_size;
+    int workers;
+    int busy;
+    long wait_avg;              /* From queued to taken by a worker */
+    long service_avg;           /* A worker's time on one client */
+    unsigned long spawned;
+    unsigned long retired;
+    unsigned long refreshes;    /* Background refreshes run */
+} WorkerPool;
+
+
+/*
+ * A kept-alive client connection waiting for its next request, watched
+ * by the idle watcher instead of holding a worker. All wait the same
+ * CLIENT_IDLE_TIMEOUT, so the list in parking order is also the order
+ * in which they expire.
+ */
+typedef struct IdleClient
+{
+    int fd;
+    time_t since;
+    struct IdleClient *prev;
+    struct IdleClient *next;
+} IdleClient;
 
-    int age;
-    int is_empty;
-    int reader_cnt;
-    sem_t mutex;
-    sem_t w;
-} CacheLine;
+typedef struct
+{
+    int epfd;
+    pthread_mutex_t mutex;
+    IdleClient list;                /* Sentinel, oldest next */
+} IdleClients;
 
 
+/*
+ * The bytes read from a client connection. The head of the request being
+ * answered is parsed in place, whatever follows it was pipelined behind.
+ */
 typedef struct
 {
-    int size;
-    CacheLine data[MAX_CACHE];
-} Cache;
+    int fd;
+    char buf[MAXBUF];
+    size_t len;
+    HttpRequest req;
+} Client;
 
 
+void *Acceptor(void *vargp);
+void SpawnWorker();
 void *Worker(void *vargp);
-void DoAndClose(int connfd);
-void ParseUri(char *uri, URI *uri_data);
-void BuildServerRequest(char *out, URI *uri_data, rio_t *client_rio);
+int RetireWorker();
+void *PoolManager(void *vargp);
+void UpdateAverage(long *avg, long sample);
+long NowUs();
+void ServeClient(int connfd);
+int DoRequest(Client *client);
+int FetchIntoCache(HttpSlice target, HttpSlice *host, int connfd, CacheEntry *stale,
+                   CacheEntry *fill, ByteRange *range, int *keep_alive);
+int RefreshInBackground(CacheEntry *stale, HttpSlice *host);
+void RefreshEntry(RefreshJob *job);
+ssize_t ReadRequest(Client *client);
+void ScanClientHeaders(HttpRequest *req, int *keep_alive, ByteRange *range, int *gzip);
+long SendEntry(int connfd, CacheEntry *entry, HttpSlice *host, ByteRange *range, int gzip,
+               int keep_alive);
+long SendCachedEntry(int connfd, CacheEntry *entry, ByteRange *range, int gzip,
+                     int keep_alive);
+int SendStats(int connfd, int json, int keep_alive);
+int FetchResponse(URI *uri_data, HttpBuilder *request, int connfd, CacheEntry **fill,
+                  CacheEntry **stale, ByteRange *range, int *keep_alive);
+int RelayResponse(rio_t *server_rio, int connfd, CacheEntry **fill, CacheEntry **stale,
+                  ByteRange *range, int *keep_alive);
+int AppendHead(int connfd, CacheEntry **fill, char *head, size_t *head_len,
+               char *line, size_t n);
+int RelayBody(rio_t *server_rio, int connfd, CacheEntry **fill, long length);
+int RelayChunked(rio_t *server_rio, int connfd, CacheEntry **fill);
+int RelayBytes(int connfd, CacheEntry **fill, char *buf, size_t n);
+int SpliceBody(rio_t *server_rio, int connfd, long *remaining);
+void CloseSplicePipe();
 void ClientError(int connectfd, char *msg);
+void Usage(char *prog);
+void SigusrHandler(int sig);
+void GetQueueStats(QueueStats *stats);
 
 
 void Init_request_queue(int n);
 void InsertRequestQueue(int item);
-int GetFromRequestQueue();
+int GetFromRequestQueue(RefreshJob **job, long *queued_at, int timeout);
+int TryQueue(int fd, RefreshJob *job);
+int TryInsertRequestQueue(int fd, RefreshJob *job);
+int TryGetFromRequestQueue(int *fd, RefreshJob **job, long *queued_at);
+long OldestQueueWait(long now);
+int FutexWait(int *addr, int val, struct timespec *timeout);
+void FutexWake(int *addr);
 
-
-void InitCache();
-size_t TryReadCache(char *url, char *obj);
-void WriteCache(char *uri, char *buf, size_t size);
-int GetCacheVictim();
-void UpdateCacheAge();
+void InitIdleClients();
+void ParkClient(int fd);
+void *IdleWatcher(void *vargp);
 
 
 /* global variables */
-Cache cache;
+char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
+                       "Gecko/20120305 Firefox/10.0.3\r\n";
 RequestQueue requset_queue;
+WorkerPool worker_pool;
+IdleClients idle_clients;
+
+/* Where a background refresh relays the response it caches */
+int discard_fd;
+
+/* The pipe SpliceBody moves bodies through, one per thread */
+__thread int splice_pipe[2] = {-1, -1};
 
 
 int main(int argc, char **argv)
 {
-    /* Setup cache, request queue, SIGPIPE handler, and thread pool. */
-    InitCache();
-    Init_request_queue(SBUFSIZE);    
+    CachePolicy *policy = FindCachePolicy("clock");
+    int event_mode = 0;
+    int level = LOG_INFO;
+    char *disk_dir = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:e:El:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'e':
+            if ((policy = FindCachePolicy(optarg)) == NULL)
+                Usage(argv[0]);
+            break;
+        case 'E':
+            event_mode = 1;
+            break;
+        case 'l':
+            if ((level = FindLogLevel(optarg)) < 0)
+                Usage(argv[0]);
+            break;
+        default:
+            Usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        Usage(argv[0]);
+
+    /* Setup log, stats, cache, resolvers and signal handlers */
+    InitLog(level);
+    InitStats();
+    if (disk_dir != NULL)
+        InitDiskCache(disk_dir);
+    InitCache(policy, disk_dir != NULL ? SpillToDisk : NULL);
+
+    /* Without the disk tier, no large object may take half the cache */
+    InitChunks(disk_dir != NULL ? DISK_CACHE_SIZE / DISK_SEGMENTS : MAX_CACHE_SIZE / 2);
+    InitResolver();
     Signal(SIGPIPE, SIG_IGN);
+    Signal(SIGUSR1, SigusrHandler);
+
+    int listenfd = Open_listenfd(argv[optind]);
+    if (event_mode)
+        ServeEvents(listenfd);
+
+    /* Otherwise a thread pool, fed by the request queue */
+    Init_request_queue(SBUFSIZE);    
+    discard_fd = Open("/dev/null", O_WRONLY, 0);
+    InitIdleClients();
     pthread_t tid;
-    for (int i = 0; i < NTHREADS; i++)
+    for (int i = 0; i < MIN_WORKERS; i++)
+    {
+        SpawnWorker();
+    }
+    Pthread_create(&tid, NULL, PoolManager, NULL);
+    Pthread_create(&tid, NULL, IdleWatcher, NULL);
+    for (int i = 1; i < NACCEPTORS; i++)
     {
-        Pthread_create(&tid, NULL, Worker, NULL);
+        Pthread_create(&tid, NULL, Acceptor, (void *) (long) listenfd);
     }
+    Acceptor((void *) (long) listenfd);
+    return 0;
+}
+
 
-    int listenfd, connfd;
+void *Acceptor(void *vargp)
+{
+    int listenfd = (long) vargp;
+    int connfd;
     socklen_t clientlen;
     char hostname[MAXLINE], port[MAXLINE];
     struct sockaddr_storage clientaddr;
-    
-    if (argc != 2)
-    {
-        fprintf(stderr, "usage :%s <port> \n", argv[0]);
-        exit(1);
-    }
+    struct timeval timeout = { CLIENT_IDLE_TIMEOUT, 0 };
+    int one = 1;
 
-    listenfd = Open_listenfd(argv[1]);
     while (1)
     {
         clientlen = sizeof(clientaddr);
         connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+
+        /* A client stalling mid request gives its worker back */
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        /*
+         * Responses are already written in few large writes, and Nagle would
+         * hold the body of a miss back until the client acks the head
+         */
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
         InsertRequestQueue(connfd);
-        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-        printf("Accepted connection from (%s %s).\n", hostname, port);
+        if (log_level <= LOG_DEBUG)
+        {
+            Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
+            LOG(LOG_DEBUG, "Accepted connection from (%s %s).", hostname, port);
+        }
     }
-    return 0;
+    return NULL;
+}
+
+
+void SpawnWorker()
+{
+    pthread_t tid;
+
+    __atomic_add_fetch(&worker_pool.workers, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&worker_pool.spawned, 1, __ATOMIC_RELAXED);
+    Pthread_create(&tid, NULL, Worker, NULL);
 }
 
 
 void *Worker(void *vargp)
 {
+    RefreshJob *job;
+    long queued_at;
+
     Pthread_detach(pthread_self());
     while (1)
     {
-        int connfd = GetFromRequestQueue(&requset_queue);
-        DoAndClose(connfd);
+        int connfd = GetFromRequestQueue(&job, &queued_at, WORKER_IDLE_TIMEOUT);
+        if (connfd < 0 && job == NULL)
+        {
+            if (RetireWorker())
+                return NULL;
+            continue;
+        }
+
+        long start = NowUs();
+        UpdateAverage(&worker_pool.wait_avg, start - queued_at);
+        __atomic_add_fetch(&worker_pool.busy, 1, __ATOMIC_RELAXED);
+        if (job != NULL)
+            RefreshEntry(job);
+        else
+            ServeClient(connfd);
+        __atomic_sub_fetch(&worker_pool.busy, 1, __ATOMIC_RELAXED);
+        UpdateAverage(&worker_pool.service_avg, NowUs() - start);
+    }
+}
+
+
+/*
+ * RetireWorker - Called by a worker that idled WORKER_IDLE_TIMEOUT.
+ *     Returns 1 if it is to exit, having given back what the thread
+ *     holds, or 0 if the pool is at MIN_WORKERS and it stays.
+ */
+int RetireWorker()
+{
+    int workers = __atomic_load_n(&worker_pool.workers, __ATOMIC_SEQ_CST);
+
+    do
+    {
+        if (workers <= MIN_WORKERS)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&worker_pool.workers, &workers, workers - 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+    __atomic_add_fetch(&worker_pool.retired, 1, __ATOMIC_RELAXED);
+    CloseSplicePipe();
+    return 1;
+}
+
+
+/*
+ * PoolManager - Every POOL_TICK, grow the pool if the oldest queued
+ *     client has waited longer than POOL_GROW_WAIT, or clients have been
+ *     waiting that long on average and no worker is free. As all queued
+ *     clients are then stuck behind busy workers, say ones held by slow
+ *     origins, it adds a worker for each, up to MAX_WORKERS.
+ */
+void *PoolManager(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        usleep(POOL_TICK);
+
+        long oldest = OldestQueueWait(NowUs());
+        int workers = __atomic_load_n(&worker_pool.workers, __ATOMIC_SEQ_CST);
+        int busy = __atomic_load_n(&worker_pool.busy, __ATOMIC_RELAXED);
+        long wait_avg = __atomic_load_n(&worker_pool.wait_avg, __ATOMIC_RELAXED);
+
+        if (oldest <= POOL_GROW_WAIT && (wait_avg <= POOL_GROW_WAIT || busy < workers))
+            continue;
+
+        long queued = __atomic_load_n(&requset_queue.enqueue_pos, __ATOMIC_RELAXED)
+                    - __atomic_load_n(&requset_queue.dequeue_pos, __ATOMIC_RELAXED);
+        if (queued < 1)
+            queued = 1;
+        for (int i = 0; i < queued && workers + i < MAX_WORKERS; i++)
+            SpawnWorker();
+        if (workers < MAX_WORKERS)
+            LOG(LOG_DEBUG, "worker pool grown from %d, oldest wait %ldus", workers, oldest);
     }
+    return NULL;
 }
 
 
-void DoAndClose(int connfd)
+/* UpdateAverage - Move the moving average *avg an eighth towards sample */
+void UpdateAverage(long *avg, long sample)
 {
-    char buf[MAXLINE];
-    char obj[MAX_OBJECT_SIZE];
-    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    
-    rio_t rio;
+    long old = __atomic_load_n(avg, __ATOMIC_RELAXED);
+
+    __atomic_store_n(avg, old + (sample - old) / 8, __ATOMIC_RELAXED);
+}
+
+
+long NowUs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/*
+ * ServeClient - Answer the requests on connfd while the client keeps the
+ *     connection open. Requests it pipelined are answered in turn, and
+ *     once none is buffered the connection is parked with the idle
+ *     watcher, which queues it again when the next request arrives.
+ */
+void ServeClient(int connfd)
+{
+    Client client;
+
+    client.fd = connfd;
+    client.len = 0;
+    do
+    {
+        if (!DoRequest(&client))
+        {
+            Close(connfd);
+            return;
+        }
+
+        /* What follows the head is the next request */
+        client.len -= client.req.parsed;
+        memmove(client.buf, client.buf + client.req.parsed, client.len);
+    } while (client.len > 0);
+
+    ParkClient(connfd);
+}
+
+
+/*
+ * DoRequest - Read one request from client and answer it. Returns 1 if
+ *     the connection stays open for another request, 0 if it must close.
+ */
+int DoRequest(Client *client)
+{
+    int connfd = client->fd;
+    HttpRequest *req = &client->req;
+    struct timespec start;
+    ssize_t head_len;
+
+    if ((head_len = ReadRequest(client)) == 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (head_len < 0)
+    {
+        ClientError(connfd, "Malformed request\n");
+        return 0;
+    }
+
+    /* Both end in a NUL in the buffer, see HttpParseRequest */
+    char *method = req->method.p, *uri = req->target.p;
+    LOG(LOG_DEBUG, "%s %s HTTP/1.%d", method, uri, req->minor);
+
+    int keep_alive = (req->minor >= 1);
+    HttpSlice *host = HttpFindHeader(req, "Host");
+    ByteRange range;
+    int gzip;
+    ScanClientHeaders(req, &keep_alive, &range, &gzip);
 
-    Rio_readinitb(&rio, connfd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    printf("%s %s %s\n", method, uri, version);
-    
     /* Only GET is implemented for now */
     if (strcasecmp(method, "GET"))
     {
         ClientError(connfd, "Proxy does not implement the method\n");
-        Close(connfd);
-        return;
+        return 0;
+    }
+
+    int json;
+    if (IsStatsRequest(uri, &json))
+        return SendStats(connfd, json, keep_alive) == 0 && keep_alive;
+
+    /*
+     * Check cache, a hit is sent straight from the cached entry. A miss on
+     * a uri another worker is fetching waits for its fill, otherwise we
+     * get the fill to cache the response into while relaying it. Before
+     * the origin, the disk tier may have the object for the fill. A range
+     * is answered from the cached object, or on a miss from the response
+     * if that is cached in chunks, otherwise with the whole object.
+     */
+    CacheEntry *entry, *fill;
+    char *result = "hit";
+    if ((entry = ReadCacheOrFill(uri, &fill)) == NULL
+        && fill != NULL && ReadDiskCache(fill) == 0)
+    {
+        entry = PinCacheEntry(fill);
+        PublishCacheFill(fill);
+        result = "disk";
     }
 
-    /* Check cache */
-    char cache_tag[MAXLINE];
-    strcpy(cache_tag, uri);
-    size_t obj_len;
-    if ((obj_len = TryReadCache(cache_tag, obj)) > 0)
+    /*
+     * A hot stale entry is still sent, within its stale window, while a
+     * worker refreshes it in the background. Otherwise a stale entry is
+     * only sent once the origin says it is still valid. The first worker
+     * to find it stale fetches into a fill that replaces it if it changed,
+     * others meanwhile revalidate it uncached.
+     */
+    CacheEntry *stale = NULL;
+    if (entry != NULL && !IsFresh(entry))
+    {
+        if (CanServeStale(entry) && RefreshInBackground(entry, host))
+        {
+            result = "stale";
+        }
+        else
+        {
+            stale = entry;
+            entry = NULL;
+            fill = BeginCacheRefresh(stale);
+        }
+    }
+    if (entry != NULL)
     {
-        printf("Found in cache, size: %lu\n", obj_len);
-        Rio_writen(connfd, obj, obj_len);
-        Close(connfd);
-        return;
+        LOG(LOG_DEBUG, "Found in cache, size: %lu", entry->obj_size + entry->chunked_size);
+        long sent = SendEntry(connfd, entry, host, &range, gzip, keep_alive);
+        long us = CountRequest(1, sent >= 0, sent >= 0 ? sent : 0, &start);
+        ReleaseCacheEntry(entry);
+        LogAccess(method, uri, result, sent >= 0, us);
+        return sent >= 0 && keep_alive;
     }
 
-    /* The file is not found in cache, try to connect server */
-    char request[MAXLINE];
-    
-    URI *uri_data = (URI *) malloc(sizeof(URI));
-    ParseUri(uri, uri_data);
-    BuildServerRequest(request, uri_data, &rio);
+    /* The file is not found in cache, or is stale, fetch it from the server */
+    int rc = FetchIntoCache(req->target, host, connfd, stale, fill, &range, &keep_alive);
 
-    int serverfd;
-    if ((serverfd = open_clientfd(uri_data->host, uri_data->port)) < 0) {
-        ClientError(connfd, "Fail to connect\n");
-        Close(connfd);
-        return;
+    /* The origin answered 304, the stale entry is sent as a hit */
+    if (rc == 1)
+    {
+        long sent = SendEntry(connfd, stale, host, &range, gzip, keep_alive);
+        long us = CountRequest(1, sent >= 0, sent >= 0 ? sent : 0, &start);
+        ReleaseCacheEntry(stale);
+        LogAccess(method, uri, "revalidated", sent >= 0, us);
+        return sent >= 0 && keep_alive;
     }
+    if (stale != NULL)
+        ReleaseCacheEntry(stale);
+    LogAccess(method, uri, stale != NULL ? "expired" : "miss", rc == 0,
+              CountRequest(0, rc == 0, 0, &start));
+    return rc == 0 && keep_alive;
+}
 
-    Rio_writen(serverfd, request, strlen(request));
 
-    rio_t server_rio;
-    int data_size = 0;
-    int n = 0;
+/*
+ * FetchIntoCache - Fetch target from its origin and relay the response to
+ *     connfd, caching it into fill unless that is NULL; the fill is
+ *     published or aborted before returning. stale, if not NULL, is the
+ *     cached entry a conditional request revalidates. Returns 1 if the
+ *     origin said stale is still valid and nothing was relayed, 0 if the
+ *     response was, -1 on error.
+ */
+int FetchIntoCache(HttpSlice target, HttpSlice *host, int connfd, CacheEntry *stale,
+                   CacheEntry *fill, ByteRange *range, int *keep_alive)
+{
+    URI uri_data;
+    HttpBuilder request;
+    char validators[2 * MAXLINE];
+    CacheEntry *validated = stale;
+    int rc = -1;
+
+    if (ParseUri(target, &uri_data) < 0)
+    {
+        ClientError(connfd, "Malformed request\n");
+    }
+    else
+    {
+        int conditional = stale != NULL && FormatValidators(validators, stale) > 0;
+        BuildServerRequest(&request, &uri_data, host, 1, conditional ? validators : NULL);
+        rc = FetchResponse(&uri_data, &request, connfd, &fill, &validated, range, keep_alive);
+    }
+
+    if (fill != NULL && (rc < 0 || validated != NULL)) {
+        AbortCacheFill(fill);
+    }
+    else if (fill != NULL) {
+        CompressCacheFill(fill);
+        LOG(LOG_DEBUG, "Write to cache, size: %lu", fill->obj_size);
+        PublishCacheFill(fill);
+    }
+
+    if (rc < 0)
+        return -1;
+    return validated != NULL;
+}
+
+
+/*
+ * RefreshInBackground - Queue a refresh of stale, a hot entry found past
+ *     its lifetime, for a worker to run. host is the Host header of the
+ *     request that found it, or NULL. Returns 1 if stale may be sent as it
+ *     is meanwhile, also when a refresh of its uri is in flight already,
+ *     or 0 if the queue is full and the caller revalidates it itself.
+ */
+int RefreshInBackground(CacheEntry *stale, HttpSlice *host)
+{
+    CacheEntry *fill;
+
+    if ((fill = BeginCacheRefresh(stale)) == NULL)
+        return 1;
+
+    RefreshJob *job = Malloc(sizeof(RefreshJob));
+    job->stale = PinCacheEntry(stale);
+    job->fill = fill;
+    job->host_len = 0;
+    if (host != NULL)
+    {
+        HttpSliceCopy(job->host, sizeof(job->host), *host);
+        job->host_len = strlen(job->host);
+    }
+
+    if (!TryQueue(-1, job))
+    {
+        AbortCacheFill(fill);
+        ReleaseCacheEntry(stale);
+        Free(job);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * RefreshEntry - Run job, revalidating its stale entry with the origin,
+ *     or caching the response that replaces it. The response is relayed
+ *     to discard_fd, no client waits on it.
+ */
+void RefreshEntry(RefreshJob *job)
+{
+    HttpSlice target = { job->stale->uri, strlen(job->stale->uri) };
+    HttpSlice host = { job->host, job->host_len };
+    ByteRange whole = { 0 };
+    int keep_alive = 1;
+    long start = NowUs();
+
+    int rc = FetchIntoCache(target, job->host_len > 0 ? &host : NULL, discard_fd,
+                            job->stale, job->fill, &whole, &keep_alive);
+    LOG(LOG_DEBUG, "Refreshed %s in %ldus: %s", job->stale->uri, NowUs() - start,
+        rc == 1 ? "not modified" : rc == 0 ? "replaced" : "failed");
+
+    __atomic_add_fetch(&worker_pool.refreshes, 1, __ATOMIC_RELAXED);
+    ReleaseCacheEntry(job->stale);
+    Free(job);
+}
+
+
+/*
+ * ReadRequest - Read from the client until the buffer holds the head of a
+ *     request, parsed into client->req. Returns the length of the head,
+ *     0 if the client went away first, or HTTP_MALFORMED, also for a head
+ *     that does not fit the buffer.
+ */
+ssize_t ReadRequest(Client *client)
+{
+    ssize_t rc, n;
+
+    HttpInitRequest(&client->req);
+    while ((rc = HttpParseRequest(&client->req, client->buf, client->len)) == HTTP_INCOMPLETE)
+    {
+        if (client->len == MAXBUF)
+            return HTTP_MALFORMED;
+        n = read(client->fd, client->buf + client->len, MAXBUF - client->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        client->len += n;
+    }
+    return rc;
+}
 
-    Rio_readinitb(&server_rio, serverfd);
-    while ((n = Rio_readlineb(&server_rio, buf, MAXLINE)) != 0)
+
+/*
+ * ScanClientHeaders - Learn from the request headers whether the client
+ *     wants the connection kept alive, *keep_alive coming in as the
+ *     default for the request's HTTP version, the range it asks for, and
+ *     whether it takes a gzip body.
+ */
+void ScanClientHeaders(HttpRequest *req, int *keep_alive, ByteRange *range, int *gzip)
+{
+    range->set = 0;
+    *gzip = 0;
+    for (int i = 0; i < req->header_cnt; i++)
     {
-        printf("proxy received %d bytes...\n", (int) n);
+        HttpHeader *h = &req->headers[i];
 
-        if(data_size + n < MAX_OBJECT_SIZE) 
+        if (!strcasecmp(h->name.p, "Connection")
+            || !strcasecmp(h->name.p, "Proxy-Connection"))
         {
-            memcpy(obj + data_size, buf, n);
+            if (HttpSliceHas(h->value, "close"))
+                *keep_alive = 0;
+            else if (HttpSliceHas(h->value, "keep-alive"))
+                *keep_alive = 1;
+        }
+        else if (!strcasecmp(h->name.p, "Range"))
+        {
+            ParseRange(h->value.p, range);
+        }
+        else if (!strcasecmp(h->name.p, "Accept-Encoding"))
+        {
+            *gzip = AcceptsGzip(&h->value);
         }
-
-        data_size += n;
-        Rio_writen(connfd, buf, n);
     }
+}
+
 
-    // Write to local cache after closing the connect
-    Close(serverfd);
-    if(data_size < MAX_OBJECT_SIZE) {
-        printf("Write to cache, size: %d\n", data_size);
-        WriteCache(cache_tag, obj, data_size);
+/*
+ * SendEntry - Send entry, a cached response, or the part of it range asks
+ *     for, to connfd. Returns the bytes sent, -1 on error.
+ */
+long SendEntry(int connfd, CacheEntry *entry, HttpSlice *host, ByteRange *range, int gzip,
+               int keep_alive)
+{
+    if (entry->chunked_size > 0)
+        return SendChunkedEntry(connfd, entry, host, range, keep_alive);
+    return SendCachedEntry(connfd, entry, range, gzip, keep_alive);
+}
+
+
+/*
+ * SendCachedEntry - Send the cached response of entry to connfd, framed
+ *     for this client, or the part of it range asks for. A client taking
+ *     gzip and the whole body is sent the gzip variant of entry instead,
+ *     if it has one. Returns the bytes sent once all of it was sent, -1
+ *     on error.
+ */
+long SendCachedEntry(int connfd, CacheEntry *entry, ByteRange *range, int gzip,
+                     int keep_alive)
+{
+    char buf[2 * MAXLINE];
+    struct iovec iov[4];
+    CacheEntry *variant = NULL;
+
+    if (gzip && !range->set && (variant = ReadGzipVariant(entry)) != NULL)
+        entry = variant;
+
+    char *body = entry->obj + entry->head_len;
+    long body_len = entry->obj_size - entry->head_len;
+    int rc = FormatRangeHead(iov, buf, entry, range, body_len, keep_alive);
+    if (variant != NULL)
+    {
+        /* Without a range the head is the cached one, and iov[1] is free */
+        iov[1].iov_base = GZIP_ENCODING_HEADER;
+        iov[1].iov_len = strlen(GZIP_ENCODING_HEADER);
+    }
+    iov[3].iov_base = body;
+    iov[3].iov_len = body_len;
+    if (rc == RANGE_PARTIAL)
+    {
+        iov[3].iov_base = body + range->first;
+        iov[3].iov_len = range->last - range->first + 1;
+    }
+    else if (rc == RANGE_UNSATISFIABLE)
+    {
+        iov[3].iov_len = 0;
     }
+
+    long sent = WritevAll(connfd, iov, 4);
+    if (variant != NULL)
+        ReleaseCacheEntry(variant);
+    return sent;
+}
+
+
+/*
+ * SendStats - Answer a request for STATS_PATH with the proxy's counters.
+ *     Returns 0 if sent, -1 if the client went away.
+ */
+int SendStats(int connfd, int json, int keep_alive)
+{
+    char *buf = Malloc(STATS_BUFSIZE);
+    QueueStats queue;
+
+    GetQueueStats(&queue);
+    size_t n = FormatStatsResponse(buf, json, &queue, keep_alive);
+    int rc = rio_writen(connfd, buf, n) < 0 ? -1 : 0;
+    Free(buf);
+    return rc;
 }
 
 
-void BuildServerRequest(char *out, URI *uri_data, rio_t *client_rio)
+/*
+ * FetchResponse - Send request to the origin of uri_data over a pooled
+ *     connection and relay the response to connfd. A pooled connection
+ *     the origin closed while it sat idle fails before any response byte,
+ *     and the request is then sent again on another one. An origin slow
+ *     to free a connection or to answer is answered for with a 504, one
+ *     with too many requests already waiting with a 503. *stale
+ *     is the cached entry a conditional request revalidates, or NULL, see
+ *     RelayResponse. Returns 0 if the whole response was relayed, or
+ *     *stale was found still valid, -1 otherwise.
+ */
+int FetchResponse(URI *uri_data, HttpBuilder *request, int connfd, CacheEntry **fill,
+                  CacheEntry **stale, ByteRange *range, int *keep_alive)
 {
-    char request[MAXLINE];
-    char host[MAXLINE];
-    char *requset_fmt = "GET %s HTTP/1.0\r\n";
-    char *host_fmt = "Host: %s\r\n";
-    sprintf(request, requset_fmt, uri_data->path);
-    sprintf(host, host_fmt, uri_data->host, uri_data->port);
-    
-    char *agent = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-    char *connect = "Connection: close\r\n";
-    char *proxy_connect = "Proxy-Connection: close\r\n";
+    rio_t server_rio;
+    int serverfd, reused, rc;
+
+    /* A background refresh does not wait for a slot a client could use */
+    int wait = connfd != discard_fd;
 
-    char buf[MAXLINE];
-    while (Rio_readlineb(client_rio, buf, MAXLINE) > 0)
+    while ((serverfd = AcquireOrigin(uri_data->host, uri_data->port, wait, &reused)) >= 0)
     {
-        if (strcmp(buf, "\r\n") == 0)
+        Rio_readinitb(&server_rio, serverfd);
+        if (WritevAll(serverfd, request->iov, request->cnt) < 0)
+            rc = RELAY_NO_RESPONSE;
+        else
+            rc = RelayResponse(&server_rio, connfd, fill, stale, range, keep_alive);
+
+        if (rc == RELAY_KEEP)
         {
+            ReleaseOrigin(uri_data->host, uri_data->port, serverfd);
+            return 0;
+        }
+        DropOrigin(uri_data->host, uri_data->port, serverfd);
+        if (rc == RELAY_TIMEOUT)
+        {
+            GatewayTimeout(connfd);
+            return -1;
+        }
+        if (rc != RELAY_NO_RESPONSE || !reused)
+            return rc == RELAY_DONE ? 0 : -1;
+    }
+
+    if (serverfd == ORIGIN_TIMEOUT)
+        GatewayTimeout(connfd);
+    else if (serverfd == ORIGIN_BUSY)
+        ServiceUnavailable(connfd);
+    else
+        ClientError(connfd, "Fail to connect\n");
+    return -1;
+}
+
+
+/*
+ * RelayResponse - Forward the response read from server_rio to connfd,
+ *     appending it to *fill while it can still be cached. The status line
+ *     and headers are read line by line to learn how the body is framed.
+ *     Framing and hop-by-hop headers are dropped, and the head goes out
+ *     in one write with our own. A chunked body is decoded, for HTTP/1.0
+ *     clients and the cache, and then ends the client connection, as does
+ *     a body running until the origin closes; *keep_alive is cleared so.
+ *     A large body cached in chunks is relayed by RelayChunks instead.
+ *     If the request revalidated *stale, a 304 renews it and nothing is
+ *     relayed, the caller sends it instead; any other response clears
+ *     *stale and is relayed, and cached in its place.
+ */
+int RelayResponse(rio_t *server_rio, int connfd, CacheEntry **fill, CacheEntry **stale,
+                  ByteRange *range, int *keep_alive)
+{
+    char head[MAXBUF + MAXLINE], line[MAXLINE];   /* Room for the framing */
+    size_t head_len = 0;
+    long content_length = -1;
+    int minor = 0, status = 0;
+    int chunked = 0, ranges = 0;
+    Freshness fresh;
+    ssize_t n;
+
+    if ((n = rio_readlineb(server_rio, line, MAXLINE)) <= 0)
+        return n < 0 && errno == EAGAIN ? RELAY_TIMEOUT : RELAY_NO_RESPONSE;
+    sscanf(line, "HTTP/1.%d %d", &minor, &status);
+    int origin_keep = (minor >= 1);
+    int no_body = (status >= 100 && status < 200) || status == 204 || status == 304;
+    int not_modified = (status == 304 && *stale != NULL);
+
+    InitFreshness(&fresh);
+    do
+    {
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n"))
             break;
+        ScanFreshness(&fresh, line);
+
+        if (!strncasecmp(line, "Content-Length:", 15))
+        {
+            content_length = strtol(line + 15, NULL, 10);
         }
-        else if (!strncasecmp(buf, "Host", strlen("Host")))
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18))
         {
-            strcpy(host, buf);
-            continue;
+            chunked = strcasestr(line + 18, "chunked") != NULL;
         }
+        else if (!strncasecmp(line, "Accept-Ranges:", 14))
+        {
+            ranges = strcasestr(line + 14, "bytes") != NULL;
+        }
+        else if (!strncasecmp(line, "Connection:", 11))
+        {
+            if (strcasestr(line + 11, "close"))
+                origin_keep = 0;
+            else if (strcasestr(line + 11, "keep-alive"))
+                origin_keep = 1;
+        }
+
+        if (!not_modified && !IsFramingHeader(line)
+            && AppendHead(connfd, fill, head, &head_len, line, n) < 0)
+            return RELAY_ERROR;
+    } while ((n = rio_readlineb(server_rio, line, MAXLINE)) > 0);
+    if (n <= 0)
+        return RELAY_ERROR;
+
+    /* A 304 without a lifetime of its own renews the one the entry had */
+    if (not_modified)
+    {
+        long lifetime = FreshnessLifetime(&fresh, (*stale)->lifetime);
+        if (lifetime >= 0)
+            RenewFreshness(*stale, lifetime);
+        return origin_keep ? RELAY_KEEP : RELAY_DONE;
+    }
+    *stale = NULL;
+
+    /* The cache keeps the head without framing, filled in when sent */
+    if (*fill != NULL)
+    {
+        long lifetime = ResponseLifetime(&fresh, status);
+        if (lifetime < 0)
+        {
+            AbortCacheFill(*fill);
+            *fill = NULL;
+        }
+        else if (!AppendCacheFill(*fill, head, head_len))
+        {
+            *fill = NULL;
+        }
+        else
+        {
+            (*fill)->head_len = (*fill)->obj_size;
+            (*fill)->lifetime = lifetime;
+            (*fill)->stale_window = StaleWindow(&fresh);
+            RenewFreshness(*fill, lifetime);
+        }
+    }
+
+    /*
+     * A large body the origin can also send in ranges is cached in chunks,
+     * unless part of a long head went out already. The head goes into the
+     * cache right away, so that clients asking for the object meanwhile
+     * read the chunks as they come in, and fetch any chunk missing later
+     * on its own.
+     */
+    if (*fill != NULL && (*fill)->obj_size == head_len && status == 200 && !chunked
+        && ranges && IsChunkable(content_length))
+    {
+        CacheEntry *entry = PinCacheEntry(*fill);
+
+        entry->chunked_size = content_length;
+        PublishCacheFill(*fill);
+        *fill = NULL;
+        int rc = RelayChunks(server_rio, connfd, entry, range, *keep_alive);
+        ReleaseCacheEntry(entry);
+        if (rc < 0)
+            return RELAY_ERROR;
+        return origin_keep && rc == 0 ? RELAY_KEEP : RELAY_DONE;
     }
 
-    sprintf(out, "%s%s%s%s%s\r\n", request,
-                                   host,
-                                   connect,
-                                   proxy_connect,
-                                   agent);
-    return;
+    long body_len = no_body ? 0 : (chunked ? -1 : content_length);
+    if (body_len < 0)
+        *keep_alive = 0;
+    head_len += FormatFraming(head + head_len, body_len, *keep_alive);
+    if (rio_writen(connfd, head, head_len) < 0)
+        return RELAY_ERROR;
+
+    int rc = 0;
+    if (chunked)
+    {
+        rc = RelayChunked(server_rio, connfd, fill);
+    }
+    else if (!no_body)
+    {
+        /* A body known to be too large is never buffered */
+        if (*fill != NULL && content_length >= 0
+            && !ReserveCacheFill(*fill, (*fill)->obj_size + content_length))
+            *fill = NULL;
+
+        /* A body that runs until the origin closes ends the connection */
+        if (content_length < 0)
+            origin_keep = 0;
+        rc = RelayBody(server_rio, connfd, fill, content_length);
+    }
+
+    if (rc < 0)
+        return RELAY_ERROR;
+    return origin_keep ? RELAY_KEEP : RELAY_DONE;
 }
 
 
-void ParseUri(char *uri, URI *uri_data)
+/* AppendHead - Add a head line to head, sending what it holds when full */
+int AppendHead(int connfd, CacheEntry **fill, char *head, size_t *head_len,
+               char *line, size_t n)
 {
-    char *host_start = strstr(uri, "//");
-    if (host_start != NULL) 
+    if (*head_len + n > MAXBUF)
     {
-        host_start += 2;
-        uri = host_start;
-    } 
+        if (RelayBytes(connfd, fill, head, *head_len) < 0)
+            return -1;
+        *head_len = 0;
+    }
+    memcpy(head + *head_len, line, n);
+    *head_len += n;
+    return 0;
+}
+
+
+/*
+ * RelayBody - Relay length bytes of body, or up to EOF if length is -1,
+ *     in RELAY_BUFSIZE blocks, or spliced between the sockets once there
+ *     is nothing to cache. Returns 0 if all of it was relayed, -1 if
+ *     either side failed or the body was cut short.
+ */
+int RelayBody(rio_t *server_rio, int connfd, CacheEntry **fill, long length)
+{
+    char buf[RELAY_BUFSIZE];
+    long remaining = length;
+    int can_splice = 1;
+    ssize_t n;
 
-    char *port_start = strstr(uri, ":");
-    if (port_start != NULL)
+    while (remaining != 0)
     {
-        port_start += 1;
-        uri = port_start;
+        if (*fill == NULL && can_splice)
+        {
+            int rc = SpliceBody(server_rio, connfd, &remaining);
+            if (rc <= 0)
+                return rc;
+            can_splice = 0;
+            continue;
+        }
+
+        size_t want = RELAY_BUFSIZE;
+        if (remaining > 0 && remaining < want)
+            want = remaining;
+        if ((n = rio_readsomeb(server_rio, buf, want)) < 0)
+            return -1;
+        if (n == 0)
+            break;
+        LOG(LOG_DEBUG, "proxy received %d bytes...", (int) n);
+
+        if (RelayBytes(connfd, fill, buf, n) < 0)
+            return -1;
+        if (remaining > 0)
+            remaining -= n;
     }
 
-    char *path_start = strstr(uri, "/");
+    return remaining > 0 ? -1 : 0;
+}
+
 
-    // check if requset specified port
-    // host:port/path
-    if (port_start != NULL)       
+/*
+ * RelayChunked - Relay a chunked body with the framing removed. Chunk
+ *     extensions and trailers are dropped.
+ */
+int RelayChunked(rio_t *server_rio, int connfd, CacheEntry **fill)
+{
+    char line[MAXLINE];
+    long size;
+
+    while (1)
     {
-        int port;
-        sscanf(port_start, "%d%s", &port, uri_data->path);
-        sprintf(uri_data->port, "%d", port);
-        *(port_start - 1) = '\0';
+        if (rio_readlineb(server_rio, line, MAXLINE) <= 0)
+            return -1;
+        if ((size = strtol(line, NULL, 16)) <= 0)
+            break;
+        if (RelayBody(server_rio, connfd, fill, size) < 0)
+            return -1;
+
+        /* The CRLF closing the chunk */
+        if (rio_readlineb(server_rio, line, MAXLINE) <= 0)
+            return -1;
     }
-    // host/path
-    else if (path_start != NULL)  
+    if (size < 0)
+        return -1;
+
+    do
     {
-        strcpy(uri_data->path, path_start);
-        strcpy(uri_data->port, "80");       // http default : port 80
-        *(path_start - 1) = '\0';
+        if (rio_readlineb(server_rio, line, MAXLINE) <= 0)
+            return -1;
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    return 0;
+}
+
+
+/* RelayBytes - Append buf to *fill if still filling, then send it to connfd */
+int RelayBytes(int connfd, CacheEntry **fill, char *buf, size_t n)
+{
+    if (*fill != NULL && !AppendCacheFill(*fill, buf, n))
+        *fill = NULL;
+    return rio_writen(connfd, buf, n) < 0 ? -1 : 0;
+}
+
+
+/*
+ * SpliceBody - Move the rest of the body from the server socket to connfd
+ *     through a pipe, so the bytes never cross into user space. *remaining
+ *     is the byte count left, or -1 for a body that ends when the server
+ *     closes. Returns 0 when done, -1 on error, and 1 if the descriptors
+ *     cannot be spliced and nothing was moved, for the caller to copy.
+ */
+int SpliceBody(rio_t *server_rio, int connfd, long *remaining)
+{
+    ssize_t n, m;
+
+    if (splice_pipe[0] < 0 && pipe(splice_pipe) < 0)
+        return 1;
+
+    /* Bytes rio has buffered already go out first */
+    if (server_rio->rio_cnt > 0)
+    {
+        n = server_rio->rio_cnt;
+        if (*remaining >= 0 && *remaining < n)
+            n = *remaining;
+        if (rio_writen(connfd, server_rio->rio_bufptr, n) < 0)
+            return -1;
+        server_rio->rio_bufptr += n;
+        server_rio->rio_cnt -= n;
+        if (*remaining > 0)
+            *remaining -= n;
+    }
+
+    while (*remaining != 0)
+    {
+        size_t want = RELAY_BUFSIZE;
+        if (*remaining > 0 && *remaining < want)
+            want = *remaining;
+
+        n = splice(server_rio->rio_fd, NULL, splice_pipe[1], NULL, want,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL)
+            return 1;
+        if (n <= 0)
+            return n < 0 ? -1 : (*remaining > 0 ? -1 : 0);
+        if (*remaining > 0)
+            *remaining -= n;
+
+        while (n > 0)
+        {
+            m = splice(splice_pipe[0], NULL, connfd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m <= 0)
+            {
+                /* The pipe still holds bytes of this body, start afresh */
+                CloseSplicePipe();
+                return -1;
+            }
+            n -= m;
+        }
+    }
+    return 0;
+}
+
+
+/* CloseSplicePipe - Close the calling thread's pipe, before it exits */
+void CloseSplicePipe()
+{
+    if (splice_pipe[0] >= 0)
+    {
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+        splice_pipe[0] = splice_pipe[1] = -1;
     }
+}
+
+
+/*
+ * BuildServerRequest - Put together in out the request for uri_data to
+ *     send upstream. host is the value of the client's Host header, kept
+ *     as is, or NULL to name uri_data->host. With keep_alive the request
+ *     asks for an HTTP/1.1 persistent connection, otherwise HTTP/1.0 and
+ *     close. extra holds more header lines, or is NULL. Nothing is copied
+ *     into out, so what it points to must stay put until it is sent.
+ */
+void BuildServerRequest(HttpBuilder *out, URI *uri_data, HttpSlice *host,
+                        int keep_alive, char *extra)
+{
+    HttpInitBuilder(out);
+    HttpAddString(out, "GET ");
+    HttpAddSlice(out, uri_data->path);
+    HttpAddString(out, keep_alive ? " HTTP/1.1\r\nHost: " : " HTTP/1.0\r\nHost: ");
+    if (host != NULL)
+        HttpAddSlice(out, *host);
+    else
+        HttpAddString(out, uri_data->host);
+    HttpAddString(out, keep_alive ? "\r\nConnection: keep-alive\r\n"
+                                  : "\r\nConnection: close\r\nProxy-Connection: close\r\n");
+    HttpAddString(out, user_agent_hdr);
+    if (extra != NULL)
+        HttpAddString(out, extra);
+    HttpAddString(out, "\r\n");
+}
 
-    if (uri && uri[0] != '/')
-        strcpy(uri_data->host, host_start);
-    return;
+
+/*
+ * ParseUri - Split the absolute request target into uri_data, the port
+ *     defaulting to 80. Returns -1 if it names no host, or one too long.
+ */
+int ParseUri(HttpSlice target, URI *uri_data)
+{
+    HttpTarget parts;
+
+    if (HttpParseTarget(target, &parts) < 0 || parts.host.len == 0
+        || parts.host.len >= sizeof(uri_data->host)
+        || parts.port.len >= sizeof(uri_data->port))
+        return -1;
+
+    HttpSliceCopy(uri_data->host, sizeof(uri_data->host), parts.host);
+    if (parts.port.len > 0)
+        HttpSliceCopy(uri_data->port, sizeof(uri_data->port), parts.port);
+    else
+        strcpy(uri_data->port, "80");
+    uri_data->path = parts.path;
+    return 0;
 }
 
 
 void ClientError(int connectfd, char *msg) {
-    printf("%s", msg);
-    Rio_writen(connectfd, msg, strlen(msg));
+    LOG(LOG_WARN, "%s", msg);
+    rio_writen(connectfd, msg, strlen(msg));
 }
 
 
-/*************************************
- * Helper function for request queue *
- *************************************/
-void Init_request_queue(int size)
+/*
+ * GatewayTimeout - Answer for an origin that did not take or answer the
+ *     request in time. Unlike ClientError a whole response, so a client
+ *     can tell it from one of the origin's, and retry later.
+ */
+void GatewayTimeout(int connfd)
 {
-    requset_queue.desciptors = Calloc(size, sizeof(int)); 
-    requset_queue.max_size = size;
-    requset_queue.front = requset_queue.rear = 0;
-    Sem_init(&requset_queue.mutex, 0, 1);
-    Sem_init(&requset_queue.slots, 0, size);
-    Sem_init(&requset_queue.items, 0, 0);
+    static char msg[] = "HTTP/1.0 504 Gateway Timeout\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: 16\r\n"
+                        "Connection: close\r\n\r\n"
+                        "Gateway Timeout\n";
+
+    LOG(LOG_WARN, "Origin did not answer in time");
+    rio_writen(connfd, msg, sizeof(msg) - 1);
 }
 
-void InsertRequestQueue(int fd)
+
+/*
+ * ServiceUnavailable - Answer for an origin with every connection in use
+ *     and as many requests waiting for one as may, without waiting.
+ */
+void ServiceUnavailable(int connfd)
 {
-    P(&requset_queue.slots); 
-    P(&requset_queue.mutex);
-    int idx = ++requset_queue.rear % requset_queue.max_size;
-    requset_queue.desciptors[idx] = fd;
-    V(&requset_queue.mutex);
-    V(&requset_queue.items);
+    static char msg[] = "HTTP/1.0 503 Service Unavailable\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: 20\r\n"
+                        "Retry-After: 1\r\n"
+                        "Connection: close\r\n\r\n"
+                        "Service Unavailable\n";
+
+    rio_writen(connfd, msg, sizeof(msg) - 1);
 }
 
 
-int GetFromRequestQueue()
+/*
+ * IsFramingHeader - Whether line is a response header the proxy drops and
+ *     writes itself: the hop-by-hop ones, and the body framing, which no
+ *     longer holds once a chunked body is decoded.
+ */
+int IsFramingHeader(char *line)
 {
-    P(&requset_queue.items);
-    P(&requset_queue.mutex);
-    int idx = ++requset_queue.front % requset_queue.max_size;
-    int fd = requset_queue.desciptors[idx];
-    V(&requset_queue.mutex);
-    V(&requset_queue.slots);
-    return fd;
+    return !strncasecmp(line, "Content-Length:", 15)
+        || !strncasecmp(line, "Transfer-Encoding:", 18)
+        || !strncasecmp(line, "Connection:", 11)
+        || !strncasecmp(line, "Keep-Alive:", 11)
+        || !strncasecmp(line, "Proxy-Connection:", 17);
 }
 
 
-/*****************************
- * Helper function for cache *
- *****************************/
+/*
+ * FormatFraming - Write the framing headers that end a response head, and
+ *     the blank line, into out. A body_len of -1 means the body runs until
+ *     the connection closes. Returns the length written.
+ */
+size_t FormatFraming(char *out, long body_len, int keep_alive)
+{
+    if (body_len < 0)
+        return sprintf(out, "Connection: close\r\n\r\n");
+    return sprintf(out, "Content-Length: %ld\r\nConnection: %s\r\n\r\n",
+                   body_len, keep_alive ? "keep-alive" : "close");
+}
 
-void InitCache()
+
+/*
+ * WritevFrom - Write what is left of the cnt buffers of iov, taken as one,
+ *     starting offset bytes in. One writev, returns what it returns.
+ */
+ssize_t WritevFrom(int fd, struct iovec *iov, int cnt, size_t offset)
 {
-    for (int i = 0; i < MAX_CACHE; i++)
+    struct iovec left[cnt];
+    int n = 0;
+
+    for (int i = 0; i < cnt; i++)
     {
-        cache.data[i].age = 0;
-        cache.data[i].is_empty = 1;
-        cache.data[i].reader_cnt = 0;
-        cache.data[i].obj_size = 0;
-        Sem_init(&cache.data[i].mutex, 0, 1);
-        Sem_init(&cache.data[i].w, 0, 1);
+        if (offset >= iov[i].iov_len)
+        {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        left[n].iov_base = (char *) iov[i].iov_base + offset;
+        left[n].iov_len = iov[i].iov_len - offset;
+        offset = 0;
+        n++;
     }
+    return writev(fd, left, n);
 }
 
 
-size_t TryReadCache(char *url, char *obj)
+/*
+ * WritevAll - Write all of the cnt buffers of iov to fd. Returns the
+ *     bytes written, or -1 on error.
+ */
+ssize_t WritevAll(int fd, struct iovec *iov, int cnt)
 {
-    for (int i = 0; i < MAX_CACHE; ++i)
+    size_t total = 0, sent = 0;
+
+    for (int i = 0; i < cnt; i++)
+        total += iov[i].iov_len;
+    while (sent < total)
     {
-        P(&cache.data[i].mutex);
-        cache.data[i].reader_cnt++;
-        if (cache.data[i].reader_cnt == 1)
-            P(&cache.data[i].w);
-        V(&cache.data[i].mutex);
+        ssize_t n = WritevFrom(fd, iov, cnt, sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        sent += n;
+    }
+    return sent;
+}
+
 
-        // Found cache
-        if (!cache.data[i].is_empty && !strcmp(url, cache.data[i].uri)) {
-            size_t size = cache.data[i].obj_size;
-            memcpy(obj, cache.data[i].obj, cache.data[i].obj_size);
+void Usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-E] [-d dir] [-e policy] [-l level] <port>\n", prog);
+    fprintf(stderr, "   -E          serve from epoll event loops, not a thread pool\n");
+    fprintf(stderr, "   -d dir      keep evicted objects on disk in dir, up to %ld MB\n",
+            DISK_CACHE_SIZE >> 20);
+    fprintf(stderr, "   -e policy   cache eviction policy: %s (default clock)\n",
+            CachePolicyNames());
+    fprintf(stderr, "   -l level    least level logged: debug, info, warn, error"
+            " (default info)\n");
+    exit(1);
+}
 
-            P(&cache.data[i].mutex);
-            cache.data[i].reader_cnt--;
-            if (cache.data[i].reader_cnt == 0)
-                V(&cache.data[i].w);
-            V(&cache.data[i].mutex);
 
-            return size;
-        }
+/*
+ * SigusrHandler - Report the cache hit ratio on SIGUSR1, so the policies
+ *     can be compared on live traffic, and how the worker pool copes.
+ *     Only async-signal-safe calls.
+ */
+void SigusrHandler(int sig)
+{
+    int olderrno = errno;
+    CacheStats stats;
+    unsigned long lookups;
+
+    GetCacheStats(&stats);
+    lookups = stats.hits + stats.misses;
+
+    Sio_puts("cache ");
+    Sio_puts(stats.policy);
+    Sio_puts(": hits ");
+    Sio_putl(stats.hits);
+    Sio_puts(" misses ");
+    Sio_putl(stats.misses);
+    Sio_puts(" coalesced ");
+    Sio_putl(stats.coalesced);
+    Sio_puts(" hit ratio ");
+    Sio_putl(lookups ? stats.hits * 100 / lookups : 0);
+    Sio_puts("% inserts ");
+    Sio_putl(stats.inserts);
+    Sio_puts(" evictions ");
+    Sio_putl(stats.evictions);
+    Sio_puts(" bytes ");
+    Sio_putl(stats.size);
+    Sio_puts("\nworkers ");
+    Sio_putl(worker_pool.workers);
+    Sio_puts(": busy ");
+    Sio_putl(worker_pool.busy);
+    Sio_puts(" spawned ");
+    Sio_putl(worker_pool.spawned);
+    Sio_puts(" retired ");
+    Sio_putl(worker_pool.retired);
+    Sio_puts(" queue wait ");
+    Sio_putl(worker_pool.wait_avg);
+    Sio_puts("us service ");
+    Sio_putl(worker_pool.service_avg);
+    Sio_puts("us\n");
+    errno = olderrno;
+}
+
+
+/* GetQueueStats - Snapshot the request queue and the worker pool */
+void GetQueueStats(QueueStats *stats)
+{
+    stats->depth = __atomic_load_n(&requset_queue.enqueue_pos, __ATOMIC_RELAXED)
+                 - __atomic_load_n(&requset_queue.dequeue_pos, __ATOMIC_RELAXED);
+    if (stats->depth < 0)
+        stats->depth = 0;
+    stats->capacity = requset_queue.mask + 1;
+    stats->workers = __atomic_load_n(&worker_pool.workers, __ATOMIC_RELAXED);
+    stats->busy = __atomic_load_n(&worker_pool.busy, __ATOMIC_RELAXED);
+    stats->spawned = __atomic_load_n(&worker_pool.spawned, __ATOMIC_RELAXED);
+    stats->retired = __atomic_load_n(&worker_pool.retired, __ATOMIC_RELAXED);
+    stats->wait_avg = __atomic_load_n(&worker_pool.wait_avg, __ATOMIC_RELAXED);
+    stats->service_avg = __atomic_load_n(&worker_pool.service_avg, __ATOMIC_RELAXED);
+    stats->refreshes = __atomic_load_n(&worker_pool.refreshes, __ATOMIC_RELAXED);
+}
+
+
+/*************************************
+ * Helper function for request queue *
+ *************************************/
+void Init_request_queue(int size)
+{
+    requset_queue.cells = Calloc(size, sizeof(QueueCell)); 
+    requset_queue.mask = size - 1;
+    for (int i = 0; i < size; i++)
+        requset_queue.cells[i].seq = i;
+    requset_queue.enqueue_pos = requset_queue.dequeue_pos = 0;
+    requset_queue.items = requset_queue.slots = 0;
+    requset_queue.item_waiters = requset_queue.slot_waiters = 0;
+}
 
-        P(&cache.data[i].mutex);
-        cache.data[i].reader_cnt--;
-        if (cache.data[i].reader_cnt == 0)
-            V(&cache.data[i].w);
-        V(&cache.data[i].mutex);
+
+/*
+ * InsertRequestQueue - Queue fd, parking while the queue is full. The
+ *     waiter count is raised before the queue is checked again, and the
+ *     futex only sleeps if no insert or get bumped it since, so a wakeup
+ *     cannot be lost between the check and the sleep.
+ */
+void InsertRequestQueue(int fd)
+{
+    int queued = TryInsertRequestQueue(fd, NULL);
+
+    while (!queued)
+    {
+        int slots = __atomic_load_n(&requset_queue.slots, __ATOMIC_SEQ_CST);
+
+        __atomic_add_fetch(&requset_queue.slot_waiters, 1, __ATOMIC_SEQ_CST);
+        if (!(queued = TryInsertRequestQueue(fd, NULL)))
+            FutexWait(&requset_queue.slots, slots, NULL);
+        __atomic_sub_fetch(&requset_queue.slot_waiters, 1, __ATOMIC_SEQ_CST);
     }
 
-    return 0;
+    __atomic_add_fetch(&requset_queue.items, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&requset_queue.item_waiters, __ATOMIC_SEQ_CST) > 0)
+        FutexWake(&requset_queue.items);
 }
 
 
-void WriteCache(char *uri, char *obj, size_t size)
+/*
+ * TryQueue - Queue fd, or job if fd is -1, if there is room, returns 1 if
+ *     so. Neither a worker serving a client, as the queue is only drained
+ *     by workers, nor the idle watcher, which has other clients to watch,
+ *     may park on a full queue, so the caller then does without or retries.
+ */
+int TryQueue(int fd, RefreshJob *job)
 {
-    int i = GetCacheVictim();
-    P(&cache.data[i].w);
+    if (!TryInsertRequestQueue(fd, job))
+        return 0;
+
+    __atomic_add_fetch(&requset_queue.items, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&requset_queue.item_waiters, __ATOMIC_SEQ_CST) > 0)
+        FutexWake(&requset_queue.items);
+    return 1;
+}
 
-    strcpy(cache.data[i].uri, uri);
-    strcpy(cache.data[i].obj, obj);
-    cache.data[i].obj_size = size;
-    UpdateCacheAge();
-    cache.data[i].is_empty = 0;
-    cache.data[i].age = 0;
 
-    V(&cache.data[i].w);
+/*
+ * GetFromRequestQueue - Take the next fd, or refresh job into *job, and
+ *     when it was queued into *queued_at, parking while the queue is
+ *     empty. Returns the fd, -1 for a job, or if none came in timeout
+ *     seconds with *job NULL; 0 waits for good.
+ */
+int GetFromRequestQueue(RefreshJob **job, long *queued_at, int timeout)
+{
+    int fd;
+    int got = TryGetFromRequestQueue(&fd, job, queued_at);
+    struct timespec wait = { timeout, 0 };
+
+    while (!got)
+    {
+        int items = __atomic_load_n(&requset_queue.items, __ATOMIC_SEQ_CST);
+        int timed_out = 0;
+
+        __atomic_add_fetch(&requset_queue.item_waiters, 1, __ATOMIC_SEQ_CST);
+        if (!(got = TryGetFromRequestQueue(&fd, job, queued_at)))
+            timed_out = FutexWait(&requset_queue.items, items, timeout ? &wait : NULL) < 0
+                        && errno == ETIMEDOUT;
+        __atomic_sub_fetch(&requset_queue.item_waiters, 1, __ATOMIC_SEQ_CST);
+        if (timed_out)
+        {
+            *job = NULL;
+            return -1;
+        }
+    }
+
+    __atomic_add_fetch(&requset_queue.slots, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&requset_queue.slot_waiters, __ATOMIC_SEQ_CST) > 0)
+        FutexWake(&requset_queue.slots);
+    return fd;
 }
 
 
-int GetCacheVictim()
+/* TryInsertRequestQueue - Queue fd, or job, if there is room; 1 if so */
+int TryInsertRequestQueue(int fd, RefreshJob *job)
 {
-    int max_age = 0;
-    int max_idx = 0;
-    for (int i = 0; i < MAX_CACHE; ++i)
+    unsigned long pos = __atomic_load_n(&requset_queue.enqueue_pos, __ATOMIC_RELAXED);
+
+    while (1)
     {
-        P(&cache.data[i].mutex);
-        cache.data[i].reader_cnt++;
-        if (cache.data[i].reader_cnt == 1)
-            P(&cache.data[i].w);
-        V(&cache.data[i].mutex);
+        QueueCell *cell = &requset_queue.cells[pos & requset_queue.mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) pos;
 
-        /* Get a Free slot */
-        if (cache.data[i].is_empty)
+        if (diff == 0)
         {
-            P(&cache.data[i].mutex);
-            cache.data[i].reader_cnt--;
-            if (cache.data[i].reader_cnt == 0)
-                V(&cache.data[i].w);
-            V(&cache.data[i].mutex);
-            return i;
+            /* On failure pos is reloaded with the current position */
+            if (__atomic_compare_exchange_n(&requset_queue.enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                cell->fd = fd;
+                cell->job = job;
+                __atomic_store_n(&cell->queued_at, NowUs(), __ATOMIC_RELAXED);
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
         }
-
-        if (cache.data[i].age > max_age)
+        else if (diff < 0)
         {
-            max_age = cache.data[i].age;
-            max_idx = i;
+            return 0;           /* Full */
         }
+        else
+        {
+            pos = __atomic_load_n(&requset_queue.enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+/* TryGetFromRequestQueue - Take the next fd or job if any, returns 1 if so */
+int TryGetFromRequestQueue(int *fd, RefreshJob **job, long *queued_at)
+{
+    unsigned long pos = __atomic_load_n(&requset_queue.dequeue_pos, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        QueueCell *cell = &requset_queue.cells[pos & requset_queue.mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) (pos + 1);
 
-        P(&cache.data[i].mutex);
-        cache.data[i].reader_cnt--;
-        if (cache.data[i].reader_cnt == 0)
-            V(&cache.data[i].w);
-        V(&cache.data[i].mutex);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&requset_queue.dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *fd = cell->fd;
+                *job = cell->job;
+                *queued_at = __atomic_load_n(&cell->queued_at, __ATOMIC_RELAXED);
+                __atomic_store_n(&cell->seq, pos + requset_queue.mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;           /* Empty */
+        }
+        else
+        {
+            pos = __atomic_load_n(&requset_queue.dequeue_pos, __ATOMIC_RELAXED);
+        }
     }
+}
+
+
+/*
+ * OldestQueueWait - How long, in us before now, the fd at the head of the
+ *     queue was queued, or 0 if the queue is empty. The cell is read
+ *     without taking it, so a get racing with us may make this a newer
+ *     fd's wait, which is good enough to decide on growing the pool.
+ */
+long OldestQueueWait(long now)
+{
+    unsigned long pos = __atomic_load_n(&requset_queue.dequeue_pos, __ATOMIC_RELAXED);
+    QueueCell *cell = &requset_queue.cells[pos & requset_queue.mask];
+
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return 0;
+    return now - __atomic_load_n(&cell->queued_at, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * FutexWait - Sleep until woken, or for at most timeout if not NULL,
+ *     unless *addr no longer holds val. Returns what the syscall does.
+ */
+int FutexWait(int *addr, int val, struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
 
-    return max_idx;
+
+void FutexWake(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+/************************************
+ * Helper function for idle clients *
+ ************************************/
+void InitIdleClients()
+{
+    if ((idle_clients.epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    pthread_mutex_init(&idle_clients.mutex, NULL);
+    idle_clients.list.prev = idle_clients.list.next = &idle_clients.list;
 }
 
 
-void UpdateCacheAge()
+/* ParkClient - Watch fd for its next request, freeing its worker */
+void ParkClient(int fd)
 {
-    for (int i = 0; i < MAX_CACHE; i++)
+    IdleClient *client = Malloc(sizeof(IdleClient));
+    struct epoll_event ev;
+
+    client->fd = fd;
+    client->since = time(NULL);
+
+    pthread_mutex_lock(&idle_clients.mutex);
+    client->prev = idle_clients.list.prev;
+    client->next = &idle_clients.list;
+    client->prev->next = client->next->prev = client;
+    pthread_mutex_unlock(&idle_clients.mutex);
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = client;
+    if (epoll_ctl(idle_clients.epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+
+/*
+ * IdleWatcher - Queue parked clients again once they send, or hang up,
+ *     and close the ones idle past CLIENT_IDLE_TIMEOUT. Checks for those
+ *     once a second, and for upstream connections idle too long. Clients
+ *     that find the queue full wait in a list of their own, tried again
+ *     every IDLE_RETRY_WAIT ms, so the watcher never blocks on the queue.
+ */
+void *IdleWatcher(void *vargp)
+{
+    struct epoll_event events[64];
+    IdleClient *client, *ready = NULL, **ready_tail = &ready;
+    time_t swept = 0;
+
+    Pthread_detach(pthread_self());
+    while (1)
     {
-        if (cache.data[i].is_empty == 0)
+        int n = epoll_wait(idle_clients.epfd, events, 64, ready ? IDLE_RETRY_WAIT : 1000);
+        if (n < 0 && errno != EINTR)
+            unix_error("epoll_wait error");
+
+        for (int i = 0; i < n; i++)
+        {
+            client = events[i].data.ptr;
+            pthread_mutex_lock(&idle_clients.mutex);
+            client->prev->next = client->next;
+            client->next->prev = client->prev;
+            pthread_mutex_unlock(&idle_clients.mutex);
+
+            epoll_ctl(idle_clients.epfd, EPOLL_CTL_DEL, client->fd, NULL);
+            client->next = NULL;
+            *ready_tail = client;
+            ready_tail = &client->next;
+        }
+
+        while (ready && TryQueue(ready->fd, NULL))
         {
-            P(&cache.data[i].w);
-            cache.data[i].age++;
-            V(&cache.data[i].w);
+            client = ready;
+            if ((ready = client->next) == NULL)
+                ready_tail = &ready;
+            Free(client);
+        }
+
+        time_t now = time(NULL);
+        while (1)
+        {
+            pthread_mutex_lock(&idle_clients.mutex);
+            client = idle_clients.list.next;
+            if (client == &idle_clients.list || now - client->since < CLIENT_IDLE_TIMEOUT)
+            {
+                pthread_mutex_unlock(&idle_clients.mutex);
+                break;
+            }
+            client->prev->next = client->next;
+            client->next->prev = client->prev;
+            pthread_mutex_unlock(&idle_clients.mutex);
+
+            epoll_ctl(idle_clients.epfd, EPOLL_CTL_DEL, client->fd, NULL);
+            Close(client->fd);
+            Free(client);
+        }
+        if (now != swept)
+        {
+            SweepOrigins();
+            swept = now;
         }
     }
+    return NULL;
 }
-
@@ -0,0 +1,43 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <sys/uio.h>
+
+#include "csapp.h"
+#include "http.h"
+
+#define NTHREADS 4
+#define RELAY_BUFSIZE 65536
+
+/* Results of RelayResponse, and of the chunk fetches in chunk.c */
+#define RELAY_TIMEOUT -3        /* The origin sent nothing in time */
+#define RELAY_NO_RESPONSE -2    /* The origin sent nothing */
+#define RELAY_ERROR -1
+#define RELAY_DONE 0            /* Relayed, the origin connection ends */
+#define RELAY_KEEP 1            /* Relayed, the origin connection is reusable */
+
+
+/* Where a request goes, host and port as C strings for the resolver */
+typedef struct
+{
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    HttpSlice path;                 /* In the target it was parsed from */
+} URI;
+
+
+/* Request helpers in proxy.c, shared with the event loops */
+int ParseUri(HttpSlice target, URI *uri_data);
+void BuildServerRequest(HttpBuilder *out, URI *uri_data, HttpSlice *host,
+                        int keep_alive, char *extra);
+int IsFramingHeader(char *line);
+size_t FormatFraming(char *out, long body_len, int keep_alive);
+ssize_t WritevFrom(int fd, struct iovec *iov, int cnt, size_t offset);
+ssize_t WritevAll(int fd, struct iovec *iov, int cnt);
+void GatewayTimeout(int connfd);
+void ServiceUnavailable(int connfd);
+
+/* Event driven mode, in event.c */
+void ServeEvents(int listenfd);
+
+#endif /* __PROXY_H__ */
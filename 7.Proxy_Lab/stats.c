@@ -0,0 +1,280 @@
+/*
+ * stats.c - Counters and latency histograms of the requests the proxy
+ *     answers, kept per thread so counting takes no lock, and the report
+ *     STATS_PATH serves, which sums them with the cache and queue stats.
+ */
+#include "cache.h"
+#include "disk.h"
+#include "stats.h"
+
+
+static RequestStats *NewStats();
+static void DropStats(void *stats);
+static void Bump(unsigned long *counter, unsigned long n);
+static size_t FormatText(char *out, CacheStats *cache, DiskStats *disk,
+                         RequestStats *req, QueueStats *queue);
+static size_t FormatJson(char *out, CacheStats *cache, DiskStats *disk,
+                         RequestStats *req, QueueStats *queue);
+static size_t FormatLatencyText(char *out, char *name, Histogram *hist);
+static size_t FormatLatencyJson(char *out, Histogram *hist);
+
+
+/* Counters of all threads that have counted, newest first */
+static RequestStats *all_stats;
+static __thread RequestStats *my_stats;
+static pthread_key_t stats_key;     /* Gives the counters back at exit */
+
+
+void InitStats()
+{
+    pthread_key_create(&stats_key, DropStats);
+}
+
+
+/*
+ * CountRequest - Count a request of the calling thread that started at
+ *     start, on CLOCK_MONOTONIC, and return how long it took in us.
+ */
+long CountRequest(int hit, int ok, size_t cache_bytes, struct timespec *start)
+{
+    RequestStats *stats = my_stats != NULL ? my_stats : NewStats();
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long us = (now.tv_sec - start->tv_sec) * 1000000
+            + (now.tv_nsec - start->tv_nsec) / 1000;
+
+    Bump(&stats->requests, 1);
+    Bump(hit ? &stats->hits : &stats->misses, 1);
+    Bump(&stats->cache_bytes, cache_bytes);
+    if (!ok)
+        Bump(&stats->failed, 1);
+    else
+        RecordHistogram(hit ? &stats->hit_latency : &stats->miss_latency, us);
+    return us;
+}
+
+
+/* GetRequestStats - Sum the counters of all threads into total */
+void GetRequestStats(RequestStats *total)
+{
+    RequestStats *stats = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE);
+
+    memset(total, 0, sizeof(RequestStats));
+    for (; stats != NULL; stats = stats->next)
+    {
+        total->requests += __atomic_load_n(&stats->requests, __ATOMIC_RELAXED);
+        total->hits += __atomic_load_n(&stats->hits, __ATOMIC_RELAXED);
+        total->misses += __atomic_load_n(&stats->misses, __ATOMIC_RELAXED);
+        total->failed += __atomic_load_n(&stats->failed, __ATOMIC_RELAXED);
+        total->cache_bytes += __atomic_load_n(&stats->cache_bytes, __ATOMIC_RELAXED);
+        MergeHistogram(&total->hit_latency, &stats->hit_latency);
+        MergeHistogram(&total->miss_latency, &stats->miss_latency);
+    }
+}
+
+
+/*
+ * IsStatsRequest - Whether uri asks for the stats, setting *json if it
+ *     asks for them as JSON.
+ */
+int IsStatsRequest(char *uri, int *json)
+{
+    size_t n = strlen(STATS_PATH);
+
+    if (strncmp(uri, STATS_PATH, n))
+        return 0;
+    *json = !strcmp(uri + n, "?format=json");
+    return *json || uri[n] == '\0' || !strcmp(uri + n, "?format=text");
+}
+
+
+/*
+ * FormatStatsResponse - Write the whole response to a stats request into
+ *     out, STATS_BUFSIZE bytes, and return its length. queue is NULL if
+ *     there is no request queue.
+ */
+size_t FormatStatsResponse(char *out, int json, QueueStats *queue, int keep_alive)
+{
+    char body[STATS_BUFSIZE - 256];
+    CacheStats cache;
+    DiskStats disk;
+    RequestStats *req = Malloc(sizeof(RequestStats));
+    size_t n;
+
+    GetCacheStats(&cache);
+    int has_disk = GetDiskStats(&disk);
+    GetRequestStats(req);
+    if (json)
+        n = FormatJson(body, &cache, has_disk ? &disk : NULL, req, queue);
+    else
+        n = FormatText(body, &cache, has_disk ? &disk : NULL, req, queue);
+    Free(req);
+
+    size_t head = sprintf(out, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                          "Cache-Control: no-store\r\nContent-Length: %lu\r\n"
+                          "Connection: %s\r\n\r\n",
+                          json ? "application/json" : "text/plain", n,
+                          keep_alive ? "keep-alive" : "close");
+    memcpy(out + head, body, n);
+    return head + n;
+}
+
+
+/* NewStats - Give the calling thread counters, ones an exited thread left if any */
+static RequestStats *NewStats()
+{
+    RequestStats *stats = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE);
+    int free = 0;
+
+    for (; stats != NULL; stats = stats->next)
+    {
+        if (__atomic_compare_exchange_n(&stats->in_use, &free, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        free = 0;
+    }
+
+    if (stats == NULL)
+    {
+        stats = Calloc(1, sizeof(RequestStats));
+        stats->in_use = 1;
+        stats->next = __atomic_load_n(&all_stats, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&all_stats, &stats->next, stats, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(stats_key, stats);
+    my_stats = stats;
+    return stats;
+}
+
+
+static void DropStats(void *stats)
+{
+    __atomic_store_n(&((RequestStats *) stats)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Bump - Add n to a counter only the calling thread writes */
+static void Bump(unsigned long *counter, unsigned long n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+
+/* FormatText - One "name value" line per figure, disk and queue may be NULL */
+static size_t FormatText(char *out, CacheStats *cache, DiskStats *disk,
+                         RequestStats *req, QueueStats *queue)
+{
+    unsigned long lookups = cache->hits + cache->misses;
+    size_t n = 0;
+
+    n += sprintf(out + n, "cache.policy %s\n", cache->policy);
+    n += sprintf(out + n, "cache.hits %lu\n", cache->hits);
+    n += sprintf(out + n, "cache.misses %lu\n", cache->misses);
+    n += sprintf(out + n, "cache.coalesced %lu\n", cache->coalesced);
+    n += sprintf(out + n, "cache.hit_ratio %.4f\n",
+                 lookups ? (double) cache->hits / lookups : 0.0);
+    n += sprintf(out + n, "cache.inserts %lu\n", cache->inserts);
+    n += sprintf(out + n, "cache.evictions %lu\n", cache->evictions);
+    n += sprintf(out + n, "cache.bytes %lu\n", cache->size);
+    n += sprintf(out + n, "cache.capacity %d\n", MAX_CACHE_SIZE);
+
+    if (disk != NULL)
+    {
+        n += sprintf(out + n, "disk.objects %lu\n", disk->objects);
+        n += sprintf(out + n, "disk.bytes %lu\n", disk->bytes);
+        n += sprintf(out + n, "disk.segments %d\n", disk->segments);
+        n += sprintf(out + n, "disk.hits %lu\n", disk->hits);
+        n += sprintf(out + n, "disk.misses %lu\n", disk->misses);
+        n += sprintf(out + n, "disk.writes %lu\n", disk->writes);
+        n += sprintf(out + n, "disk.dropped %lu\n", disk->dropped);
+    }
+
+    n += sprintf(out + n, "requests.total %lu\n", req->requests);
+    n += sprintf(out + n, "requests.hits %lu\n", req->hits);
+    n += sprintf(out + n, "requests.misses %lu\n", req->misses);
+    n += sprintf(out + n, "requests.failed %lu\n", req->failed);
+    n += sprintf(out + n, "requests.cache_bytes %lu\n", req->cache_bytes);
+    n += FormatLatencyText(out + n, "hit", &req->hit_latency);
+    n += FormatLatencyText(out + n, "miss", &req->miss_latency);
+
+    if (queue != NULL)
+    {
+        n += sprintf(out + n, "queue.depth %ld\n", queue->depth);
+        n += sprintf(out + n, "queue.capacity %ld\n", queue->capacity);
+        n += sprintf(out + n, "queue.wait_avg_us %ld\n", queue->wait_avg);
+        n += sprintf(out + n, "workers.total %d\n", queue->workers);
+        n += sprintf(out + n, "workers.busy %d\n", queue->busy);
+        n += sprintf(out + n, "workers.spawned %lu\n", queue->spawned);
+        n += sprintf(out + n, "workers.retired %lu\n", queue->retired);
+        n += sprintf(out + n, "workers.service_avg_us %ld\n", queue->service_avg);
+        n += sprintf(out + n, "workers.refreshes %lu\n", queue->refreshes);
+    }
+    return n;
+}
+
+
+static size_t FormatJson(char *out, CacheStats *cache, DiskStats *disk,
+                         RequestStats *req, QueueStats *queue)
+{
+    unsigned long lookups = cache->hits + cache->misses;
+    size_t n = 0;
+
+    n += sprintf(out + n, "{\"cache\":{\"policy\":\"%s\",\"hits\":%lu,\"misses\":%lu,"
+                 "\"coalesced\":%lu,\"hit_ratio\":%.4f,\"inserts\":%lu,"
+                 "\"evictions\":%lu,\"bytes\":%lu,\"capacity\":%d},",
+                 cache->policy, cache->hits, cache->misses, cache->coalesced,
+                 lookups ? (double) cache->hits / lookups : 0.0, cache->inserts,
+                 cache->evictions, cache->size, MAX_CACHE_SIZE);
+
+    if (disk != NULL)
+    {
+        n += sprintf(out + n, "\"disk\":{\"objects\":%lu,\"bytes\":%lu,\"segments\":%d,"
+                     "\"hits\":%lu,\"misses\":%lu,\"writes\":%lu,\"dropped\":%lu},",
+                     disk->objects, disk->bytes, disk->segments, disk->hits,
+                     disk->misses, disk->writes, disk->dropped);
+    }
+
+    n += sprintf(out + n, "\"requests\":{\"total\":%lu,\"hits\":%lu,\"misses\":%lu,"
+                 "\"failed\":%lu,\"cache_bytes\":%lu,\"latency_us\":{\"hit\":",
+                 req->requests, req->hits, req->misses, req->failed, req->cache_bytes);
+    n += FormatLatencyJson(out + n, &req->hit_latency);
+    n += sprintf(out + n, ",\"miss\":");
+    n += FormatLatencyJson(out + n, &req->miss_latency);
+    n += sprintf(out + n, "}}");
+
+    if (queue != NULL)
+    {
+        n += sprintf(out + n, ",\"queue\":{\"depth\":%ld,\"capacity\":%ld,"
+                     "\"wait_avg_us\":%ld},\"workers\":{\"total\":%d,\"busy\":%d,"
+                     "\"spawned\":%lu,\"retired\":%lu,\"service_avg_us\":%ld,"
+                     "\"refreshes\":%lu}",
+                     queue->depth, queue->capacity, queue->wait_avg, queue->workers,
+                     queue->busy, queue->spawned, queue->retired, queue->service_avg,
+                     queue->refreshes);
+    }
+    n += sprintf(out + n, "}\n");
+    return n;
+}
+
+
+static size_t FormatLatencyText(char *out, char *name, Histogram *hist)
+{
+    return sprintf(out, "latency_us.%s.count %lu\nlatency_us.%s.p50 %ld\n"
+                   "latency_us.%s.p90 %ld\nlatency_us.%s.p99 %ld\n"
+                   "latency_us.%s.p999 %ld\nlatency_us.%s.max %ld\n",
+                   name, hist->total, name, HistogramPercentile(hist, 0.5),
+                   name, HistogramPercentile(hist, 0.9), name, HistogramPercentile(hist, 0.99),
+                   name, HistogramPercentile(hist, 0.999), name, hist->max);
+}
+
+
+static size_t FormatLatencyJson(char *out, Histogram *hist)
+{
+    return sprintf(out, "{\"count\":%lu,\"p50\":%ld,\"p90\":%ld,\"p99\":%ld,"
+                   "\"p999\":%ld,\"max\":%ld}",
+                   hist->total, HistogramPercentile(hist, 0.5), HistogramPercentile(hist, 0.9),
+                   HistogramPercentile(hist, 0.99), HistogramPercentile(hist, 0.999), hist->max);
+}
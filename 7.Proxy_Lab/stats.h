@@ -0,0 +1,53 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+#include "histogram.h"
+
+/* Admin path the proxy answers itself, in text or with ?format=json */
+#define STATS_PATH "/__stats"
+#define STATS_BUFSIZE 16384
+
+
+/*
+ * Counters of the requests one thread answered. Only that thread writes
+ * them, with plain stores, and GetRequestStats sums the counters of all
+ * threads when asked. A thread that exits leaves its counters to the
+ * next thread that starts answering requests.
+ */
+typedef struct RequestStats
+{
+    unsigned long requests;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long failed;
+    unsigned long cache_bytes;      /* Bytes sent from cached objects */
+    Histogram hit_latency;          /* us, of requests answered in full */
+    Histogram miss_latency;
+    int in_use;                     /* Owned by a live thread */
+    struct RequestStats *next;
+} RequestStats;
+
+
+/* The request queue and worker pool, of the thread pool mode */
+typedef struct
+{
+    long depth;
+    long capacity;
+    int workers;
+    int busy;
+    unsigned long spawned;
+    unsigned long retired;
+    long wait_avg;
+    long service_avg;
+    unsigned long refreshes;        /* Stale entries refreshed in the background */
+} QueueStats;
+
+
+void InitStats();
+long CountRequest(int hit, int ok, size_t cache_bytes, struct timespec *start);
+void GetRequestStats(RequestStats *total);
+int IsStatsRequest(char *uri, int *json);
+size_t FormatStatsResponse(char *out, int json, QueueStats *queue, int keep_alive);
+
+#endif /* __STATS_H__ */
@@ -7,9 +7,10 @@
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
  */
 #include "csapp.h"
+#include "http.h"
 
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+int read_request(int fd, char *buf, HttpRequest *req);
 int parse_uri(char *uri, char *filename, char *cgiargs);
 void serve_static(int fd, char *filename, int filesize);
 void get_filetype(char *filename, char *filetype);
@@ -51,22 +52,26 @@ void doit(int fd)
 {
     int is_static;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char buf[MAXBUF], *method, *uri;
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    HttpRequest req;
 
     /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
+    switch (read_request(fd, buf, &req)) {               //line:netp:doit:readrequest
+    case HTTP_INCOMPLETE:
         return;
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
+    case HTTP_MALFORMED:
+        clienterror(fd, "request", "400", "Bad Request",
+                    "Tiny couldn't parse the request");
+        return;
+    }
+    method = req.method.p;                               //line:netp:doit:parserequest
+    uri = req.target.p;
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented",
                     "Tiny does not implement this method");
         return;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
@@ -96,22 +101,39 @@ void doit(int fd)
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_request - read the request head into buf, MAXBUF bytes, parsing
+ *                it into req as it arrives. Returns its length, or
+ *                HTTP_INCOMPLETE if the client went away first, or
+ *                HTTP_MALFORMED if it is not one or does not fit
  */
-/* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+/* $begin read_request */
+int read_request(int fd, char *buf, HttpRequest *req) 
 {
-    char buf[MAXLINE];
+    size_t len = 0;
+    ssize_t n, rc;
+    int i;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
+    HttpInitRequest(req);
+    while ((rc = HttpParseRequest(req, buf, len)) == HTTP_INCOMPLETE) {
+	if (len == MAXBUF)
+	    return HTTP_MALFORMED;
+	if ((n = read(fd, buf + len, MAXBUF - len)) <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    return HTTP_INCOMPLETE;
+	}
+	len += n;
     }
-    return;
+    if (rc < 0)
+	return HTTP_MALFORMED;
+
+    printf("%s %s HTTP/1.%d\n", req->method.p, req->target.p, req->minor);
+    for (i = 0; i < req->header_cnt; i++)
+	printf("%s: %s\n", req->headers[i].name.p, req->headers[i].value.p);
+    printf("\n");
+    return rc;
 }
-/* $end read_requesthdrs */
+/* $end read_request */
 
 /*
  * parse_uri - parse URI into filename and CGI args